@@ -0,0 +1,288 @@
+#include "mnist.h"
+
+// Benchmarks of the kernels at the shapes training uses, and of a whole
+// training step:
+//   bench [--csv | --json] [--filter text] [--save file] [--baseline file]
+//         [--tolerance fraction] [--tune file]
+// Each benchmark is repeated for at least min_seconds; the fastest run is
+// kept. --save writes the results as JSON, which --baseline reads back to
+// flag every benchmark that got slower by more than the tolerance; bench
+// then exits with status 1. --tune multiplies with the GEMM configurations
+// tuned for the network's shapes, tuning them first if they are not saved
+// in the file.
+
+const double min_seconds = 0.3;
+const size_t bench_batch = batch_size;
+const size_t bench_micro_batch = 1000;
+
+struct BenchResult
+{
+    string  name;
+    double  seconds;    // per run
+    double  flops;      // per run, 0 if not meaningful
+    double  bytes;      // moved per run, 0 if not meaningful
+    double  samples;    // per run, 0 if not meaningful
+    double  allocs;     // tensor allocations per run
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+template <typename F>
+BenchResult measure(const string& name, double flops, double bytes, double samples, const F& fn)
+{
+    fn();                                           // warm up
+    double best = 1e30;
+    size_t runs = 0;
+    const size_t allocs = tensor_allocs;
+    const auto start = bench_clock::now();
+    do {
+        const auto t0 = bench_clock::now();
+        fn();
+        best = min(best, std::chrono::duration<double>(bench_clock::now() - t0).count());
+        runs++;
+    } while(std::chrono::duration<double>(bench_clock::now() - start).count() < min_seconds);
+    BenchResult r = { name, best, flops, bytes, samples, (double)(tensor_allocs - allocs) / runs };
+    return r;
+}
+
+Tensor2D<float> random_tensor(size_t rows, size_t cols)
+{
+    Tensor2D<float> t(rows, cols);
+    for(size_t r = 0; r < rows; ++r)
+        for(size_t c = 0; c < cols; ++c) t[r][c] = genrand();
+    return t;
+}
+
+vector<BenchResult> run_benchmarks(const string& filter)
+{
+    vector<BenchResult> results;
+    auto wanted = [&](const string& name) { return name.find(filter) != string::npos; };
+    const size_t b = bench_batch;
+    const size_t in = pixels, h1 = 512, h2 = 1024, out = 10;
+
+    // dot at the network's shapes: forward, the weight gradients (left
+    // transposed) and the gradients flowing back (right transposed)
+    struct Shape { const char* name; size_t m, k, n; bool tleft, tright; };
+    const Shape shapes[] = {
+        { "dot_fwd1",  b,  in, h1,  false, false },
+        { "dot_fwd2",  b,  h1, h2,  false, false },
+        { "dot_fwd3",  b,  h2, out, false, false },
+        { "dot_wgrad1", in, b, h1,  true,  false },
+        { "dot_wgrad2", h1, b, h2,  true,  false },
+        { "dot_wgrad3", h2, b, out, true,  false },
+        { "dot_bwd3",  b,  out, h2, false, true  },
+        { "dot_bwd2",  b,  h2, h1,  false, true  },
+    };
+    for(const Shape& s : shapes) {
+        if(!wanted(s.name)) continue;
+        const Tensor2D<float> left = s.tleft ? random_tensor(s.k, s.m) : random_tensor(s.m, s.k);
+        const Tensor2D<float> right = s.tright ? random_tensor(s.n, s.k) : random_tensor(s.k, s.n);
+        Tensor2D<float> c(s.m, s.n);
+        const double bytes = 4.0 * (s.m * s.k + s.k * s.n + s.m * s.n);
+        results.push_back(measure(s.name, 2.0 * s.m * s.n * s.k, bytes, 0,
+                                  [&] { dot(c, left, right, s.tleft, s.tright); }));
+    }
+
+    // Elementwise operations on the largest activations
+    Tensor2D<float> x = random_tensor(b, h2), y = random_tensor(b, h2), z(b, h2);
+    const Tensor2D<float> bias = random_tensor(1, h2);
+    const double elems = (double)b * h2;
+    if(wanted("add"))
+        results.push_back(measure("add", elems, 12 * elems, 0, [&] { add(z, x, y); }));
+    if(wanted("add_bias"))
+        results.push_back(measure("add_bias", elems, 8 * elems, 0, [&] { add(z, x, bias); }));
+    if(wanted("mul"))
+        results.push_back(measure("mul", elems, 8 * elems, 0, [&] { z = mul(x, 0.5f); }));
+    if(wanted("transpose"))
+        results.push_back(measure("transpose", 0, 8 * elems, 0, [&] { z = transpose(x); }));
+    if(wanted("copy"))
+        results.push_back(measure("copy", 0, 8 * elems, 0, [&] { y = x; }));
+    if(wanted("relu"))                      // includes a copy, to keep the signs random
+        results.push_back(measure("relu", elems, 16 * elems, 0, [&] { y = x; relu(y); }));
+    if(wanted("sgd_update"))
+        results.push_back(measure("sgd_update", 3 * elems, 12 * elems, 0,
+                                  [&] { sgd_update(y, x, 1e-6, 0.5); }));
+
+    // Softmax over the scores, alone and with the loss and its gradient
+    Tensor2D<float> scores = random_tensor(b, out), probs(b, out);
+    Tensor2D<size_t> labels(b, 1);
+    for(size_t r = 0; r < b; ++r) labels[r][0] = r % out;
+    const double selems = (double)b * out;
+    if(wanted("softmax"))
+        results.push_back(measure("softmax", 0, 8 * selems, b, [&] { softmax(probs, scores); }));
+    if(wanted("softmax_xent"))
+        results.push_back(measure("softmax_xent", 0, 8 * selems, b,
+                                  [&] { softmax_xent(scores, labels, probs); }));
+
+    // Batches from the MNIST files, when they are there
+    if(wanted("fetch")) {
+        try {
+            MNISTDataLoader train(train_data, train_label);
+            batchtype batch(Tensor2D<uint8_t>(b, pixels), Tensor2D<size_t>(b, 1));
+            results.push_back(measure("fetch", 0, (double)b * pixels, b,
+                                      [&] { train.fetch(batch); }));
+        } catch(const runtime_error& e) {
+            cerr << "fetch skipped: " << e.what() << endl;
+        }
+    }
+
+    // A whole training step on a batch of bytes, at once and in micro-batches
+    batchtype batch(Tensor2D<uint8_t>(b, pixels), Tensor2D<size_t>(b, 1));
+    for(size_t r = 0; r < b; ++r) {
+        for(size_t c = 0; c < pixels; ++c) batch.first[r][c] = (r * 7 + c * 13) % 5 ? 0 : (r + c) % 256;
+        batch.second[r][0] = r % out;
+    }
+    const double flops = 6.0 * b * (in * h1 + h1 * h2 + h2 * out);
+    const size_t micros[] = { b, bench_micro_batch };
+    for(size_t micro : micros) {
+        const string name = micro == b ? "train_step" : "train_step_micro" + to_string(micro);
+        if(!wanted(name)) continue;
+        Network<precision, storage> nt(in, out, h1, h2, micro);
+        results.push_back(measure(name, flops, 0, b, [&] {
+            nt.gradients(batch.first, batch.second, nullptr, micro);
+            nt.opt(1e-6);
+        }));
+    }
+
+    // The same step through MNISTNetwork, whose widths are fixed at compile
+    // time, to compare with train_step
+    if(wanted("train_step_sequential")) {
+        static_assert(MNISTNetwork::inputs() == pixels && MNISTNetwork::outputs() == 10 &&
+                      MNISTNetwork::activations() == 512 + 1024 + 10, "train_step's shapes");
+        MNISTNetwork seq(b);
+        results.push_back(measure("train_step_sequential", flops, 0, b, [&] {
+            seq.forward(batch.first);
+            seq.backward(batch.second, batch.first);
+            seq.opt(1e-6);
+        }));
+    }
+    return results;
+}
+
+void print_table(const vector<BenchResult>& results)
+{
+    cout << left << setw(22) << "benchmark" << right << setw(12) << "ms" << setw(10) << "GFLOP/s";
+    cout << setw(10) << "GB/s" << setw(14) << "samples/s" << setw(10) << "allocs" << endl;
+    for(const BenchResult& r : results) {
+        cout << left << setw(22) << r.name << right << fixed << setprecision(3);
+        cout << setw(12) << r.seconds * 1e3 << setprecision(1);
+        cout << setw(10) << r.flops / r.seconds / 1e9 << setw(10) << r.bytes / r.seconds / 1e9;
+        cout << setprecision(0) << setw(14) << r.samples / r.seconds;
+        cout << setprecision(1) << setw(10) << r.allocs << endl;
+    }
+}
+
+void print_csv(ostream& out, const vector<BenchResult>& results)
+{
+    out << "name,seconds,gflops,gbps,samples_per_second,allocs" << endl;
+    for(const BenchResult& r : results) {
+        out << r.name << "," << scientific << setprecision(6) << r.seconds << fixed << setprecision(3);
+        out << "," << r.flops / r.seconds / 1e9 << "," << r.bytes / r.seconds / 1e9;
+        out << "," << r.samples / r.seconds << "," << r.allocs << endl;
+    }
+}
+
+// One result per line, so that read_baseline() need not parse JSON
+void print_json(ostream& out, const vector<BenchResult>& results)
+{
+    out << "[" << endl;
+    for(size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "{\"name\": \"" << r.name << "\", \"seconds\": " << scientific << setprecision(6);
+        out << r.seconds << fixed << setprecision(3);
+        out << ", \"gflops\": " << r.flops / r.seconds / 1e9;
+        out << ", \"gbps\": " << r.bytes / r.seconds / 1e9;
+        out << ", \"samples_per_second\": " << r.samples / r.seconds;
+        out << ", \"allocs\": " << r.allocs << "}" << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "]" << endl;
+}
+
+vector<BenchResult> read_baseline(const string& path)
+{
+    ifstream in(path.c_str());
+    if(!in) throw runtime_error(msg3.c_str());
+    vector<BenchResult> results;
+    string line;
+    while(getline(in, line)) {
+        const size_t name = line.find("\"name\": \"");
+        const size_t seconds = line.find("\"seconds\": ");
+        const size_t allocs = line.find("\"allocs\": ");
+        if(name == string::npos || seconds == string::npos) continue;
+        BenchResult r = BenchResult();
+        const size_t begin = name + 9;
+        r.name = line.substr(begin, line.find('"', begin) - begin);
+        r.seconds = atof(line.c_str() + seconds + 11);
+        if(allocs != string::npos) r.allocs = atof(line.c_str() + allocs + 10);
+        results.push_back(r);
+    }
+    return results;
+}
+
+// Benchmarks slower than in baseline by more than tolerance, or that
+// allocate more; returns how many
+size_t compare(const vector<BenchResult>& results, const vector<BenchResult>& baseline,
+               double tolerance)
+{
+    size_t slower = 0;
+    cout << left << setw(22) << "benchmark" << right << setw(12) << "baseline ms";
+    cout << setw(12) << "ms" << setw(10) << "change" << endl;
+    for(const BenchResult& r : results)
+        for(const BenchResult& b : baseline) {
+            if(b.name != r.name) continue;
+            const double change = r.seconds / b.seconds - 1;
+            const bool flagged = change > tolerance || r.allocs > b.allocs;
+            slower += flagged;
+            cout << left << setw(22) << r.name << right << fixed << setprecision(3);
+            cout << setw(12) << b.seconds * 1e3 << setw(12) << r.seconds * 1e3;
+            cout << setprecision(1) << setw(9) << change * 100 << "%";
+            if(change > tolerance) cout << "  SLOWER";
+            if(r.allocs > b.allocs) cout << "  MORE ALLOCATIONS";
+            cout << endl;
+        }
+    return slower;
+}
+
+int main(int argc, char** argv)
+{
+    string format = "table", filter, save, baseline, tune;
+    double tolerance = 0.1;
+    for(int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        const bool more = i + 1 < argc;
+        if(arg == "--csv") format = "csv";
+        else if(arg == "--json") format = "json";
+        else if(arg == "--filter" && more) filter = argv[++i];
+        else if(arg == "--save" && more) save = argv[++i];
+        else if(arg == "--baseline" && more) baseline = argv[++i];
+        else if(arg == "--tolerance" && more) tolerance = atof(argv[++i]);
+        else if(arg == "--tune" && more) tune = argv[++i];
+        else {
+            cerr << "usage: bench [--csv | --json] [--filter text] [--save file] "
+                    "[--baseline file] [--tolerance fraction] [--tune file]" << endl;
+            return 2;
+        }
+    }
+
+    if(!tune.empty()) {
+        const Network<precision> shapes(pixels, 10, 512, 1024, 1);
+        gemm_autotune(shapes.gemm_shapes(bench_batch), tune);
+    }
+    cerr << num_threads() << " threads, GEMM kernel " << gemm_kernel().name;
+    cerr << ", " << gemm_tuned().size() << " tuned shapes" << endl;
+    const vector<BenchResult> results = run_benchmarks(filter);
+    if(format == "csv") print_csv(cout, results);
+    else if(format == "json") print_json(cout, results);
+    else print_table(results);
+
+    if(!save.empty()) {
+        ofstream out(save.c_str());
+        print_json(out, results);
+    }
+    if(!baseline.empty()) {
+        const size_t slower = compare(results, read_baseline(baseline), tolerance);
+        cout << slower << " of " << results.size() << " benchmarks regressed" << endl;
+        return slower ? 1 : 0;
+    }
+    return 0;
+}
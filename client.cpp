@@ -0,0 +1,65 @@
+#include "mnist.h"
+
+// Load generator for the inference server:
+//   client [socket [connections [requests [in flight]]]]
+// Each connection sends requests images of the test set, keeping up to
+// in flight of them unanswered, and checks the predicted labels.
+int main(int argc, char** argv)
+{
+    const string path = argc > 1 ? argv[1] : serve_socket;
+    const size_t connections = argc > 2 ? atoi(argv[2]) : 8;
+    const size_t requests = argc > 3 ? atoi(argv[3]) : 1000;
+    const size_t depth = max(1, argc > 4 ? atoi(argv[4]) : 1);
+
+    MNISTDataLoader test(test_data, test_label);
+    batchtype images(Tensor2D<uint8_t>(0, 0), Tensor2D<size_t>(0, 1));
+    test.fetch(images, 0, min(requests, test.numitems()));
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    LatencyStats stats;
+    atomic<size_t> correct(0), failed(0);
+    vector<thread> threads;
+    for(size_t c = 0; c < connections; ++c)
+        threads.push_back(thread([&, c] {
+            const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+                failed += requests;
+                if(fd >= 0) close(fd);
+                return;
+            }
+            typedef std::chrono::steady_clock clock;
+            deque<clock::time_point> sent;
+            InferenceReply reply;
+            size_t next = 0;
+            for(size_t done = 0; done < requests; ++done) {
+                while(next < requests && next < done + depth) {
+                    const size_t item = (c + next * connections) % images.first.rows();
+                    sent.push_back(clock::now());
+                    if(!write_full(fd, images.first[item], pixels)) break;
+                    next++;
+                }
+                if(!read_full(fd, &reply, sizeof(reply))) {
+                    failed += requests - done;
+                    break;
+                }
+                const double latency = std::chrono::duration<double>(clock::now() - sent.front()).count();
+                sent.pop_front();
+                stats.record(&latency, 1);
+                const size_t item = (c + done * connections) % images.first.rows();
+                if(reply.label == images.second[item][0]) correct++;
+            }
+            close(fd);
+        }));
+    for(thread& t : threads) t.join();
+
+    const LatencyStats::Summary s = stats.take();
+    cout << connections << " connections, " << depth << " in flight each: ";
+    print_latency(cout, s, false);
+    cout << "Accuracy: " << setprecision(3) << (s.count ? (double)correct / s.count : 0);
+    cout << ", failed: " << failed << endl;
+    return failed ? 1 : 0;
+}
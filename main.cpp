@@ -1,8 +1,9 @@
 #include "mnist.h"
 #include <sys/resource.h>
 
-int main()
+// mnist [micro-batch rows]
+int main(int argc, char** argv)
 {
-    mnist();
+    mnist(argc > 1 ? atoi(argv[1]) : micro_batch);
     return 0;
 }
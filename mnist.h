@@ -2,13 +2,37 @@
 #include <string>
 #include <cassert>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <random>
 #include <string>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+#include <new>
 #include <cmath>
 #include <ctime>
 #include <iomanip>
+#include <vector>
+#include <numeric>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <list>
+#include <type_traits>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 using namespace std;
 
@@ -17,9 +41,28 @@ using namespace std;
 // -----------------------------------------------------------------------------
 const size_t num_epochs = 10;
 const size_t batch_size = 5000;
+const size_t micro_batch = 0;    // rows per forward/backward pass, 0 for the whole batch
 const size_t pixels     = 784;   // 28 * 28
 const float  wt_reg     = 0.5;   // weight regularization strength
 const float  learn_rate = 0.001; 
+const unsigned shuffle_seed  = 1;  // seed of the per-epoch order of samples
+const size_t   shuffle_block = 1;  // shuffle items in runs of this many
+const float    pixel_scale   = 1.0; // raw pixel bytes are multiplied by this
+const float    sparse_density = 0.4; // layer1 uses sparse kernels below this
+const size_t   replicas       = 1;   // data-parallel replicas per batch
+const bool     deterministic_reduce = true; // sum replica gradients in a fixed order
+const size_t   eval_interval  = 1;   // batches between evaluations, 0 for none
+const size_t   eval_chunk     = 1000;   // rows evaluated at a time
+const size_t   eval_train_items = 10000; // evaluated on the first these of train
+const size_t   quant_calib_items = 2000; // train items that calibrate int8 inference
+const char*    checkpoint_path = "mnist.ckpt";
+const size_t   checkpoint_interval = 4;  // batches between checkpoints, 0 for none
+const char*    serve_socket    = "mnist.sock";
+const size_t   serve_max_batch = 64;     // most requests the server evaluates at once
+const double   serve_deadline  = 0.002;  // seconds a request may wait for a batch
+const char*    profile_path    = "mnist_profile.jsonl"; // phase totals per epoch, "" for none
+const char*    trace_path      = "mnist_trace.json";    // trace of every phase, "" for none
+const char*    gemm_tuning_path = "";   // file of tuned GEMM configurations, "" not to tune
 
 const char* train_data  = "data/train-images-idx3-ubyte";
 const char* train_label = "data/train-labels-idx1-ubyte";
@@ -42,507 +85,4526 @@ std::mt19937 gen(rd());
 string msg1 = "Tensor2D operation: indexes were out of range";
 string msg2 = "left and right tensors do not have appropriate dimensions for dot product";
 string msg3 = "could not open file for reading";
+string msg4 = "not a valid IDX file, or not the expected shape";
+string msg5 = "not a valid checkpoint file, or not of this network";
+string msg6 = "could not write checkpoint file";
+string msg7 = "could not listen on the server socket";
+
+// -----------------------------------------------------------------------------
+// Profiling
+// -----------------------------------------------------------------------------
+// Scoped timers over the phases of training. Each scope adds its wall time,
+// the FLOPs and bytes it was given, the tensor allocations its thread made
+// and the samples it handled to its phase's totals, which take() hands out
+// and resets, e.g. once per epoch. With tracing on, every scope is kept as
+// well, for a Chrome trace (chrome://tracing, Perfetto).
+//
+// Build with -DMNIST_PROFILE=0 to compile the scopes, and their cost, out.
+#ifndef MNIST_PROFILE
+#define MNIST_PROFILE 1
+#endif
+
+enum Phase
+{
+    phase_step,         // one iteration of the training loop
+    phase_wait,         // waiting for the next batch
+    phase_fetch,        // copying a batch out of the files
+    phase_forward,      // Network::forward
+    phase_linear,       // Linear::forward, within the others
+    phase_backward,     // Network::backward
+    phase_opt,          // Network::opt
+    phase_eval,         // accuracy on a data set
+    phase_checkpoint,   // writing a checkpoint
+    num_phases
+};
+
+const char* const phase_names[num_phases] = {
+    "step", "wait", "fetch", "forward", "linear", "backward", "opt", "eval", "checkpoint"
+};
+
+// Phases whose nested scopes are traced but not added to the totals, so
+// that evaluating does not count as forward passes of training
+inline bool phase_isolates(Phase p) { return p == phase_eval; }
+
+// Totals of a phase
+struct PhaseStats
+{
+    uint64_t calls, nanos, allocs, items;
+    double   flops, bytes;
+
+    PhaseStats() : calls(0), nanos(0), allocs(0), items(0), flops(0), bytes(0) {}
+    double seconds() const { return nanos * 1e-9; }
+};
+
+// A finished scope, with nanoseconds since the profiler started
+struct TraceEvent
+{
+    Phase    phase;
+    uint32_t tid;
+    int64_t  start, nanos;
+    double   flops, bytes;
+    uint64_t items;
+};
+
+// Tensor allocations made by the calling thread
+inline uint64_t& thread_allocs() {
+    static thread_local uint64_t n = 0;
+    return n;
+}
+
+class Profiler
+{
+    public:
+        static const size_t max_events = 1 << 20;
+
+        Profiler() : _start(std::chrono::steady_clock::now()), _tracing(false), _dropped(0) {
+            for(size_t p = 0; p < num_phases; ++p)
+                for(size_t f = 0; f < fields; ++f) _totals[p][f] = 0;
+        }
+
+        // Keep every scope from now on, up to max_events
+        void trace(bool on) { _tracing = on; }
+
+        void add(const TraceEvent& e, uint64_t allocs, bool total) {
+            if(total) {
+                atomic<uint64_t>* t = _totals[e.phase];
+                t[0].fetch_add(1, memory_order_relaxed);
+                t[1].fetch_add(e.nanos, memory_order_relaxed);
+                t[2].fetch_add(allocs, memory_order_relaxed);
+                t[3].fetch_add(e.items, memory_order_relaxed);
+                t[4].fetch_add(llround(e.flops), memory_order_relaxed);
+                t[5].fetch_add(llround(e.bytes), memory_order_relaxed);
+            }
+            if(_tracing) {
+                lock_guard<mutex> lk(_mutex);
+                if(_events.size() < max_events) _events.push_back(e);
+                else _dropped++;
+            }
+        }
+
+        // The totals of every phase since the last call
+        vector<PhaseStats> take() {
+            vector<PhaseStats> stats(num_phases);
+            for(size_t p = 0; p < num_phases; ++p) {
+                atomic<uint64_t>* t = _totals[p];
+                stats[p].calls = t[0].exchange(0);
+                stats[p].nanos = t[1].exchange(0);
+                stats[p].allocs = t[2].exchange(0);
+                stats[p].items = t[3].exchange(0);
+                stats[p].flops = t[4].exchange(0);
+                stats[p].bytes = t[5].exchange(0);
+            }
+            return stats;
+        }
+
+        // Write the traced scopes in the trace event format, as complete
+        // ("X") events in microseconds, one track per thread
+        bool write_trace(const string& path) const {
+            ofstream out(path.c_str());
+            lock_guard<mutex> lk(_mutex);
+            out << "{\"traceEvents\": [" << endl << fixed << setprecision(3);
+            for(size_t i = 0; i < _events.size(); ++i) {
+                const TraceEvent& e = _events[i];
+                out << "{\"name\": \"" << phase_names[e.phase] << "\", \"ph\": \"X\", \"pid\": 1";
+                out << ", \"tid\": " << e.tid << ", \"ts\": " << e.start * 1e-3;
+                out << ", \"dur\": " << e.nanos * 1e-3 << ", \"args\": {\"flops\": " << e.flops;
+                out << ", \"bytes\": " << e.bytes << ", \"samples\": " << e.items << "}}";
+                out << (i + 1 < _events.size() ? "," : "") << endl;
+            }
+            out << "], \"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped\": " << _dropped << "}}" << endl;
+            return bool(out);
+        }
+
+        int64_t now() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - _start).count();
+        }
+
+    private:
+        static const size_t fields = 6;     // as in PhaseStats
+
+        std::chrono::steady_clock::time_point _start;
+        atomic<uint64_t>    _totals[num_phases][fields];
+        atomic<bool>        _tracing;
+        mutable mutex       _mutex;
+        vector<TraceEvent>  _events;
+        size_t              _dropped;
+};
+
+Profiler& profiler() {
+    static Profiler p;
+    return p;
+}
+
+// Times its own lifetime as one call of phase. The work it did may be given
+// up front or, once known, with work().
+class ProfileScope
+{
+    public:
+        explicit ProfileScope(Phase phase, double flops = 0, double bytes = 0, uint64_t items = 0)
+            : _allocs(thread_allocs()), _outer(isolating()) {
+            _event.phase = phase;
+            _event.tid = thread_id();
+            _event.flops = flops;
+            _event.bytes = bytes;
+            _event.items = items;
+            if(!_outer && phase_isolates(phase)) isolating() = this;
+            _event.start = profiler().now();
+        }
+
+        ~ProfileScope() {
+            _event.nanos = profiler().now() - _event.start;
+            if(isolating() == this) isolating() = nullptr;
+            profiler().add(_event, thread_allocs() - _allocs, !_outer);
+        }
+
+        void work(double flops, double bytes, uint64_t items) {
+            _event.flops = flops;
+            _event.bytes = bytes;
+            _event.items = items;
+        }
+
+    private:
+        TraceEvent    _event;
+        uint64_t      _allocs;
+        ProfileScope* _outer;       // the isolating scope this one is in
+
+        ProfileScope(const ProfileScope&) = delete;
+        ProfileScope& operator=(const ProfileScope&) = delete;
+
+        static ProfileScope*& isolating() {
+            static thread_local ProfileScope* scope = nullptr;
+            return scope;
+        }
+
+        static uint32_t thread_id() {
+            static atomic<uint32_t> next(1);
+            static thread_local uint32_t id = next++;
+            return id;
+        }
+};
+
+// PROFILE_SCOPE(phase[, flops, bytes, samples]) times the rest of the
+// enclosing block; PROFILE_WORK(flops, bytes, samples) sets its work later
+#if MNIST_PROFILE
+#define PROFILE_SCOPE(...) ProfileScope profile_scope(__VA_ARGS__)
+#define PROFILE_WORK(...)  profile_scope.work(__VA_ARGS__)
+#else
+#define PROFILE_SCOPE(...) ((void)0)
+#define PROFILE_WORK(...)  ((void)0)
+#endif
+
+// One line per phase that ran, with its work per second
+void print_profile(ostream& out, const vector<PhaseStats>& stats)
+{
+    out << "Phases:" << fixed;
+    for(size_t p = 0; p < stats.size(); ++p) {
+        const PhaseStats& s = stats[p];
+        if(!s.calls) continue;
+        out << " " << phase_names[p] << " " << setprecision(2) << s.seconds() << " s";
+        if(s.flops) out << " (" << setprecision(1) << s.flops / s.seconds() / 1e9 << " GFLOP/s)";
+        else if(p == phase_step) out << " (" << setprecision(0) << s.items / s.seconds() << " samples/s)";
+        out << ";";
+    }
+    out << endl;
+}
+
+// The totals of epoch (0 for after the last one) as JSON lines, one per phase
+void write_profile(ostream& out, size_t epoch, const vector<PhaseStats>& stats)
+{
+    for(size_t p = 0; p < stats.size(); ++p) {
+        const PhaseStats& s = stats[p];
+        if(!s.calls) continue;
+        const double t = s.seconds();
+        out << "{\"epoch\": " << epoch << ", \"phase\": \"" << phase_names[p] << "\"";
+        out << ", \"calls\": " << s.calls << fixed << setprecision(6) << ", \"seconds\": " << t;
+        out << setprecision(3) << ", \"gflops\": " << (t ? s.flops / t / 1e9 : 0);
+        out << ", \"gbps\": " << (t ? s.bytes / t / 1e9 : 0);
+        out << ", \"samples_per_second\": " << (t ? s.items / t : 0);
+        out << ", \"allocs\": " << s.allocs << "}" << endl;
+    }
+}
+
+// The profile of a training run: epoch() prints the totals since the last
+// call and appends them to totals_path; the trace is written to trace_path
+// on destruction. Either path may be empty. Does nothing if profiling is
+// compiled out.
+class ProfileLog
+{
+    public:
+        explicit ProfileLog(const string& totals_path, const string& trace_path)
+            : _trace_path(trace_path) {
+#if MNIST_PROFILE
+            if(!totals_path.empty()) _totals.open(totals_path.c_str());
+            profiler().take();
+            profiler().trace(!trace_path.empty());
+#endif
+        }
+
+        ~ProfileLog() {
+#if MNIST_PROFILE
+            profiler().trace(false);
+            if(!_trace_path.empty() && !profiler().write_trace(_trace_path))
+                cerr << "could not write " << _trace_path << endl;
+#endif
+        }
+
+        void epoch(size_t n) {
+#if MNIST_PROFILE
+            const vector<PhaseStats> stats = profiler().take();
+            print_profile(cout, stats);
+            if(_totals.is_open()) write_profile(_totals, n, stats);
+#endif
+        }
+
+    private:
+        string   _trace_path;
+        ofstream _totals;
+};
 
 // -----------------------------------------------------------------------------
 // Tensor infrastructure and operations
 // -----------------------------------------------------------------------------
 
+// Tensor buffers are aligned to a cache line and every row is padded to a
+// multiple of it, so that each row starts on an aligned address
+const size_t tensor_align = 64;
+
+// Number of buffers handed out by aligned_malloc(), i.e. tensor and kernel
+// scratch allocations. Steady-state training should not move it.
+atomic<size_t> tensor_allocs(0);
+
+// Allocate memory aligned to tensor_align, release it with free()
+void* aligned_malloc(size_t bytes) {
+    void* p = nullptr;
+    if(posix_memalign(&p, tensor_align, bytes) != 0)
+        throw bad_alloc();
+    tensor_allocs++;
+#if MNIST_PROFILE
+    thread_allocs()++;
+#endif
+    return p;
+}
+
 template <typename T>
 class Tensor2D
 {
     public:
         explicit Tensor2D(size_t rows, size_t cols)
-            : _rows(rows), _cols(cols), _data(nullptr) {
-                alloc(_rows, _cols);
+            : _rows(rows), _cols(cols), _stride(padded(cols)),
+              _capacity(rows * _stride), _data(nullptr), _view(false) {
+                alloc();
                 fill(0.0);
         }
 
-        Tensor2D(const Tensor2D& rhs): _data(nullptr) {
-            copy(rhs);
+        Tensor2D(const Tensor2D& rhs)
+            : _rows(rhs._rows), _cols(rhs._cols), _stride(rhs._stride),
+              _capacity(rhs._rows * rhs._stride), _data(nullptr), _view(false) {
+                alloc();
+                copy(rhs);
+        }
+
+        Tensor2D(Tensor2D&& rhs) noexcept
+            : _rows(rhs._rows), _cols(rhs._cols), _stride(rhs._stride),
+              _capacity(rhs._capacity), _data(rhs._data), _view(rhs._view) {
+                rhs._data = nullptr;
+                rhs._rows = rhs._cols = rhs._stride = rhs._capacity = 0;
+        }
+
+        // A tensor over memory owned by someone else, e.g. a mapped file,
+        // laid out as Tensor2D lays out its own: aligned, rows padded to
+        // stride(). It is never freed; copies of it own their memory, and
+        // growing it with resize() moves it to memory of its own.
+        static Tensor2D view(T* data, size_t rows, size_t cols) {
+            assert(reinterpret_cast<uintptr_t>(data) % tensor_align == 0);
+            Tensor2D t(0, 0);
+            t._rows = rows; t._cols = cols; t._stride = padded(cols);
+            t._capacity = rows * t._stride;
+            t._data = data;
+            t._view = true;
+            return t;
         }
 
         Tensor2D& operator=(const Tensor2D& rhs) {
             if(this != &rhs) {
-                dealloc();
+                resize(rhs._rows, rhs._cols);
                 copy(rhs);
             }
             return *this;
         }
 
+        Tensor2D& operator=(Tensor2D&& rhs) noexcept {
+            if(this != &rhs) {
+                dealloc();
+                _rows = rhs._rows; _cols = rhs._cols; _stride = rhs._stride;
+                _capacity = rhs._capacity;
+                _data = rhs._data;
+                _view = rhs._view;
+                rhs._data = nullptr;
+                rhs._rows = rhs._cols = rhs._stride = rhs._capacity = 0;
+            }
+            return *this;
+        }
+
         ~Tensor2D() {
             dealloc();
         }
 
-        T* const operator[](size_t r) {
-            return _data[r];
+        T* const operator[](size_t r) {
+            return _data + r * _stride;
+        }
+
+        const T* const operator[](size_t r) const {
+            return _data + r * _stride;
+        }
+        
+        // Padding elements are filled as well, so that kernels may
+        // process whole rows of stride() elements
+        void fill(T setval) {
+            std::fill(_data, _data + _rows * _stride, setval);
+        }
+
+        // Change the shape, reallocating only when the buffer is too small.
+        // The contents are unspecified afterwards.
+        void resize(size_t rows, size_t cols) {
+            const size_t stride = padded(cols);
+            if(rows * stride > _capacity) {
+                dealloc();
+                _capacity = rows * stride;
+                alloc();
+                std::fill(_data, _data + _capacity, T());
+            }
+            _rows = rows; _cols = cols; _stride = stride;
+        }
+
+        size_t rows()   const { return _rows; }
+        size_t cols()   const { return _cols; }
+        size_t stride() const { return _stride; }
+        bool   is_view() const { return _view; }
+
+        T*       data()       { return _data; }
+        const T* data() const { return _data; }
+
+    private:
+        size_t      _rows;
+        size_t      _cols;
+        size_t      _stride;    // elements between the start of two rows
+        size_t      _capacity;  // elements allocated
+        T*          _data;
+        bool        _view;      // _data is not ours to free
+
+        // Round the row length up to a multiple of the alignment
+        static size_t padded(size_t cols) {
+            if(tensor_align % sizeof(T) != 0) return cols;
+            const size_t n = tensor_align / sizeof(T);
+            return (cols + n - 1) / n * n;
+        }
+
+        void copy(const Tensor2D& rhs) {
+            assert(_stride == rhs._stride);
+            if(_rows) memcpy(_data, rhs._data, _rows * _stride * sizeof(T));
+        }
+
+        void alloc() {
+            assert((!_data) && "_data is not null");
+            if(_capacity == 0) return;
+            _data = static_cast<T*>(aligned_malloc(_capacity * sizeof(T)));
+        }
+
+        void dealloc() {
+            if(!_view) free(_data);
+            _data = nullptr;
+            _view = false;
+        }
+
+};
+
+// -----------------------------------------------------------------------------
+// Thread pool
+// -----------------------------------------------------------------------------
+// Worker threads are started once and sleep between jobs. A job is a number
+// of independent tasks; workers and the calling thread pull task indexes from
+// a shared counter until none are left. Jobs submitted from within a task,
+// from another serial_thread(), or while another thread owns the pool, run
+// serially on the caller.
+
+// Set on threads whose jobs must run serially: the pool's own workers, and
+// background threads that should not compete with the training loop for it
+bool& serial_thread() {
+    static thread_local bool flag = false;
+    return flag;
+}
+
+class ThreadPool
+{
+    public:
+        typedef void (*task_fn)(const void* ctx, size_t task);
+
+        explicit ThreadPool(size_t threads)
+            : _fn(nullptr), _ctx(nullptr), _tasks(0), _next(0), _active(0),
+              _generation(0), _stop(false) {
+                resize(threads);
+        }
+
+        ~ThreadPool() {
+            stop();
+        }
+
+        // Number of threads working on a job, including the caller
+        size_t size() const { return _workers.size() + 1; }
+
+        void resize(size_t threads) {
+            lock_guard<mutex> submit(_submit);
+            stop();
+            _stop = false;
+            for(size_t i = 1; i < max<size_t>(threads, 1); ++i)
+                _workers.push_back(thread(&ThreadPool::work, this));
+        }
+
+        // Run fn(ctx, i) for every i in [0, tasks) and wait for completion
+        void run(size_t tasks, task_fn fn, const void* ctx) {
+            if(tasks == 0) return;
+            if(tasks == 1 || _workers.empty() || serial_thread() || !_submit.try_lock()) {
+                for(size_t i = 0; i < tasks; ++i) fn(ctx, i);
+                return;
+            }
+            {
+                lock_guard<mutex> lk(_mutex);
+                _fn = fn; _ctx = ctx; _tasks = tasks; _next = 0;
+                _active = _workers.size();
+                _generation++;
+            }
+            _wake.notify_all();
+            serial_thread() = true;     // for jobs our own tasks submit
+            execute();
+            serial_thread() = false;
+            {
+                unique_lock<mutex> lk(_mutex);
+                _done.wait(lk, [this] { return _active == 0; });
+            }
+            _submit.unlock();
+        }
+
+    private:
+        vector<thread>      _workers;
+        mutex               _submit;    // held by the thread owning the job
+        mutex               _mutex;
+        condition_variable  _wake, _done;
+        task_fn             _fn;
+        const void*         _ctx;
+        size_t              _tasks;
+        atomic<size_t>      _next;
+        size_t              _active;    // workers yet to finish the job
+        size_t              _generation;
+        bool                _stop;
+
+        void execute() {
+            size_t i;
+            while((i = _next.fetch_add(1)) < _tasks)
+                _fn(_ctx, i);
+        }
+
+        void work() {
+            serial_thread() = true;
+            size_t seen = 0;
+            unique_lock<mutex> lk(_mutex);
+            for(;;) {
+                _wake.wait(lk, [&] { return _stop || _generation != seen; });
+                if(_stop) return;
+                seen = _generation;
+                lk.unlock();
+                execute();
+                lk.lock();
+                if(--_active == 0) _done.notify_one();
+            }
+        }
+
+        void stop() {
+            {
+                lock_guard<mutex> lk(_mutex);
+                _stop = true;
+            }
+            _wake.notify_all();
+            for(size_t i = 0; i < _workers.size(); ++i)
+                _workers[i].join();
+            _workers.clear();
+        }
+};
+
+ThreadPool& pool() {
+    static ThreadPool p(max(thread::hardware_concurrency(), 1u));
+    return p;
+}
+
+// Number of threads used by the tensor operations, the caller included
+void set_num_threads(size_t n) { pool().resize(n); }
+size_t num_threads() { return pool().size(); }
+
+// Run fn(i) for i in [0, tasks) on the pool
+template <typename F>
+void parallel_for(size_t tasks, const F& fn) {
+    pool().run(tasks, [](const void* ctx, size_t i) {
+        (*static_cast<const F*>(ctx))(i);
+    }, &fn);
+}
+
+// Split [0, n) into one contiguous range per thread, each at least grain
+// long, and run fn(begin, end) on them
+template <typename F>
+void parallel_range(size_t n, size_t grain, const F& fn) {
+    const size_t chunks = max<size_t>(1, min(num_threads(), n / max<size_t>(grain, 1)));
+    parallel_for(chunks, [&](size_t i) {
+        fn(n * i / chunks, n * (i + 1) / chunks);
+    });
+}
+
+// Rows per task so that a task touches at least ~64 KB of floats
+inline size_t row_grain(size_t cols) {
+    return max<size_t>(1, 16384 / max<size_t>(cols, 1));
+}
+
+// -----------------------------------------------------------------------------
+// Matrix multiplication
+// -----------------------------------------------------------------------------
+// C = A * B on row-major matrices, organised like GotoBLAS/BLIS. B is copied
+// ("packed") in blocks of kc x nc that stay in L3, A in blocks of mc x kc that
+// stay in L2, and a micro-kernel keeps an mr x nr tile of C in registers while
+// streaming through the packed panels. The micro-kernel is picked at startup
+// from the instruction sets the CPU supports.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+// Micro-kernel: C[mr x nr] = (C +) Ap * Bp, where Ap holds kc columns of mr
+// values of A and Bp holds kc rows of nr values of B
+typedef void (*gemm_ukernel)(size_t kc, const float* a, const float* b,
+                             float* c, size_t ldc, bool accumulate);
+
+struct GemmKernel
+{
+    const char*  name;
+    size_t       mr, nr;        // register tile
+    size_t       mc, kc, nc;    // cache blocking
+    gemm_ukernel run;
+    bool         (*supported)();
+};
+
+// Largest register tile of all the kernels, for edge tiles
+const size_t gemm_max_tile = 12 * 32;
+
+// Portable kernel, written so that the compiler can vectorise the inner loop
+template <size_t MR, size_t NR>
+void gemm_ukernel_scalar(size_t kc, const float* a, const float* b,
+                         float* c, size_t ldc, bool accumulate) {
+    float acc[MR][NR] = {};
+    for(size_t k = 0; k < kc; ++k, a += MR, b += NR)
+        for(size_t i = 0; i < MR; ++i)
+            for(size_t j = 0; j < NR; ++j)
+                acc[i][j] += a[i] * b[j];
+    for(size_t i = 0; i < MR; ++i)
+        for(size_t j = 0; j < NR; ++j)
+            c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j] : acc[i][j];
+}
+
+bool cpu_any() { return true; }
+
+#ifdef GEMM_X86
+bool cpu_avx2()   { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"); }
+bool cpu_avx512() { return __builtin_cpu_supports("avx512f"); }
+bool cpu_f16c()   { return __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c"); }
+bool cpu_avx512bf16() {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bf16");
+}
+bool cpu_avxvnni() { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("avxvnni"); }
+bool cpu_avx512vnni() {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vnni");
+}
+
+// 6x16 tile: 12 ymm accumulators
+__attribute__((target("avx2,fma")))
+void gemm_ukernel_avx2(size_t kc, const float* a, const float* b,
+                       float* c, size_t ldc, bool accumulate) {
+    __m256 acc[6][2];
+    #pragma GCC unroll 6
+    for(size_t i = 0; i < 6; ++i)
+        acc[i][0] = acc[i][1] = _mm256_setzero_ps();
+    for(size_t k = 0; k < kc; ++k, a += 6, b += 16) {
+        const __m256 b0 = _mm256_load_ps(b);
+        const __m256 b1 = _mm256_load_ps(b + 8);
+        #pragma GCC unroll 6
+        for(size_t i = 0; i < 6; ++i) {
+            const __m256 ai = _mm256_broadcast_ss(a + i);
+            acc[i][0] = _mm256_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm256_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    #pragma GCC unroll 6
+    for(size_t i = 0; i < 6; ++i, c += ldc) {
+        if(accumulate) {
+            acc[i][0] = _mm256_add_ps(acc[i][0], _mm256_loadu_ps(c));
+            acc[i][1] = _mm256_add_ps(acc[i][1], _mm256_loadu_ps(c + 8));
+        }
+        _mm256_storeu_ps(c, acc[i][0]);
+        _mm256_storeu_ps(c + 8, acc[i][1]);
+    }
+}
+
+// 12x32 tile: 24 zmm accumulators
+__attribute__((target("avx512f")))
+void gemm_ukernel_avx512(size_t kc, const float* a, const float* b,
+                         float* c, size_t ldc, bool accumulate) {
+    __m512 acc[12][2];
+    #pragma GCC unroll 12
+    for(size_t i = 0; i < 12; ++i)
+        acc[i][0] = acc[i][1] = _mm512_setzero_ps();
+    for(size_t k = 0; k < kc; ++k, a += 12, b += 32) {
+        const __m512 b0 = _mm512_load_ps(b);
+        const __m512 b1 = _mm512_load_ps(b + 16);
+        #pragma GCC unroll 12
+        for(size_t i = 0; i < 12; ++i) {
+            const __m512 ai = _mm512_set1_ps(a[i]);
+            acc[i][0] = _mm512_fmadd_ps(ai, b0, acc[i][0]);
+            acc[i][1] = _mm512_fmadd_ps(ai, b1, acc[i][1]);
+        }
+    }
+    #pragma GCC unroll 12
+    for(size_t i = 0; i < 12; ++i, c += ldc) {
+        if(accumulate) {
+            acc[i][0] = _mm512_add_ps(acc[i][0], _mm512_loadu_ps(c));
+            acc[i][1] = _mm512_add_ps(acc[i][1], _mm512_loadu_ps(c + 16));
+        }
+        _mm512_storeu_ps(c, acc[i][0]);
+        _mm512_storeu_ps(c + 16, acc[i][1]);
+    }
+}
+#endif
+
+// Ordered from the most to the least preferred
+GemmKernel gemm_kernels[] = {
+#ifdef GEMM_X86
+    { "avx512", 12, 32, 192, 512, 2048, gemm_ukernel_avx512, cpu_avx512 },
+    { "avx2",    6, 16,  96, 256, 4096, gemm_ukernel_avx2,   cpu_avx2   },
+#endif
+    { "scalar",  4, 16,  64, 256, 4096, gemm_ukernel_scalar<4, 16>, cpu_any },
+};
+const size_t num_gemm_kernels = sizeof(gemm_kernels) / sizeof(gemm_kernels[0]);
+
+GemmKernel* best_gemm_kernel() {
+    for(size_t i = 0; i < num_gemm_kernels; ++i)
+        if(gemm_kernels[i].supported()) return &gemm_kernels[i];
+    return &gemm_kernels[num_gemm_kernels - 1];
+}
+
+GemmKernel* active_gemm_kernel = best_gemm_kernel();
+
+const GemmKernel& gemm_kernel() {
+    return *active_gemm_kernel;
+}
+
+// The kernel, cache blocking and number of threads of one product
+struct GemmConfig
+{
+    const GemmKernel* kernel;
+    size_t            mc, kc, nc;
+    size_t            threads;      // 0 for all of them
+
+    explicit GemmConfig(const GemmKernel& kr = gemm_kernel())
+        : kernel(&kr), mc(kr.mc), kc(kr.kc), nc(kr.nc), threads(0) {}
+};
+
+// C[m x n] = op(A)[m x k] * op(B)[k x n]
+struct GemmShape
+{
+    bool   trans_a, trans_b;
+    size_t m, n, k;
+};
+
+// A configuration found to be the fastest for products like shape
+struct GemmTuned
+{
+    GemmShape  shape;
+    GemmConfig config;
+    double     gflops;
+};
+
+// Configurations set by the autotuner, each used for the products of the
+// same transposes, n and k, and an m within the same power of two as its
+// shape's. It must not change while other threads multiply.
+vector<GemmTuned>& gemm_tuned() {
+    static vector<GemmTuned> tuned;
+    return tuned;
+}
+
+inline size_t gemm_size_class(size_t m) {
+    size_t c = 0;
+    while(m >>= 1) c++;
+    return c;
+}
+
+inline bool gemm_same_class(const GemmShape& x, const GemmShape& y) {
+    return x.trans_a == y.trans_a && x.trans_b == y.trans_b && x.n == y.n && x.k == y.k &&
+           gemm_size_class(x.m) == gemm_size_class(y.m);
+}
+
+// The configuration for a product: the tuned one, or the active kernel's
+inline GemmConfig gemm_config(const GemmShape& shape) {
+    const vector<GemmTuned>& tuned = gemm_tuned();
+    for(size_t i = 0; i < tuned.size(); ++i)
+        if(gemm_same_class(tuned[i].shape, shape)) return tuned[i].config;
+    return GemmConfig();
+}
+
+// Force a kernel by name (e.g. for testing), returns false if the name is
+// unknown or the CPU does not support it. Tuned configurations, which may
+// name other kernels, are dropped.
+bool set_gemm_kernel(const string& name) {
+    for(size_t i = 0; i < num_gemm_kernels; ++i)
+        if(name == gemm_kernels[i].name && gemm_kernels[i].supported()) {
+            active_gemm_kernel = &gemm_kernels[i];
+            gemm_tuned().clear();
+            return true;
+        }
+    return false;
+}
+
+// 16 bit floating point storage: bf16 (the exponent range of float with an
+// 8 bit mantissa) and fp16 (IEEE half precision). They convert implicitly
+// to and from float, rounding to nearest even, and are only stored: all
+// arithmetic is done in float.
+inline uint16_t bf16_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, 4);
+    if((u & 0x7fffffff) > 0x7f800000) return (u >> 16) | 0x40;     // quiet NaN
+    return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+inline float bf16_value(uint16_t h) {
+    const uint32_t u = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &u, 4);
+    return f;
+}
+
+inline uint16_t fp16_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, 4);
+    const uint32_t sign = (u >> 16) & 0x8000;
+    u &= 0x7fffffff;
+    if(u >= 0x47800000)                     // 65536 and up: inf, or NaN
+        return sign | (u > 0x7f800000 ? 0x7e00 : 0x7c00);
+    if(u < 0x38800000) {                    // below 2^-14: subnormal or zero
+        // Adding 0.5 leaves the result in the low mantissa bits, rounded
+        float v;
+        memcpy(&v, &u, 4);
+        v += 0.5f;
+        memcpy(&u, &v, 4);
+        return sign | (u - 0x3f000000);
+    }
+    u += 0xc8000fff + ((u >> 13) & 1);      // rebias the exponent and round
+    return sign | (u >> 13);
+}
+
+inline float fp16_value(uint16_t h) {
+    uint32_t u = (uint32_t)(h & 0x7fff) << 13;
+    const uint32_t exp = u & 0x0f800000;
+    u += 0x38000000;                        // rebias the exponent
+    float f;
+    if(exp == 0x0f800000) {                 // inf or NaN
+        u += 0x38000000;
+        memcpy(&f, &u, 4);
+    } else if(exp == 0) {                   // subnormal or zero
+        u += 0x00800000;
+        memcpy(&f, &u, 4);
+        f -= 6.103515625e-05f;              // 2^-14
+    } else {
+        memcpy(&f, &u, 4);
+    }
+    return (h & 0x8000) ? -f : f;
+}
+
+struct bf16
+{
+    uint16_t bits;
+    bf16() = default;
+    bf16(float f) : bits(bf16_bits(f)) {}
+    operator float() const { return bf16_value(bits); }
+};
+
+struct fp16
+{
+    uint16_t bits;
+    fp16() = default;
+    fp16(float f) : bits(fp16_bits(f)) {}
+    operator float() const { return fp16_value(bits); }
+};
+
+// Type of the weight copies and activations the network computes with; its
+// master weights and gradients stay in precision. One of precision, bf16
+// or fp16.
+typedef precision storage;
+
+// Convert rows of n values between float and the storage types
+void widen_bf16_scalar(const uint16_t* src, float* dst, size_t n) {
+    for(size_t i = 0; i < n; ++i) dst[i] = bf16_value(src[i]);
+}
+
+void narrow_bf16_scalar(const float* src, uint16_t* dst, size_t n) {
+    for(size_t i = 0; i < n; ++i) dst[i] = bf16_bits(src[i]);
+}
+
+void widen_fp16_scalar(const uint16_t* src, float* dst, size_t n) {
+    for(size_t i = 0; i < n; ++i) dst[i] = fp16_value(src[i]);
+}
+
+void narrow_fp16_scalar(const float* src, uint16_t* dst, size_t n) {
+    for(size_t i = 0; i < n; ++i) dst[i] = fp16_bits(src[i]);
+}
+
+#ifdef GEMM_X86
+__attribute__((target("avx2")))
+void widen_bf16_avx2(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        const __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(h, 16)));
+    }
+    widen_bf16_scalar(src + i, dst + i, n - i);
+}
+
+// Round to nearest even on the integer representation; NaN is left to the
+// scalar code's rules by quieting it the same way
+__attribute__((target("avx2")))
+void narrow_bf16_avx2(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    const __m256i one = _mm256_set1_epi32(1), bias = _mm256_set1_epi32(0x7fff);
+    const __m256i abs = _mm256_set1_epi32(0x7fffffff), inf = _mm256_set1_epi32(0x7f800000);
+    const __m256i quiet = _mm256_set1_epi32(0x400000);
+    for(; i + 8 <= n; i += 8) {
+        const __m256i u = _mm256_castps_si256(_mm256_loadu_ps(src + i));
+        const __m256i odd = _mm256_and_si256(_mm256_srli_epi32(u, 16), one);
+        __m256i r = _mm256_add_epi32(u, _mm256_add_epi32(bias, odd));
+        const __m256i nan = _mm256_cmpgt_epi32(_mm256_and_si256(u, abs), inf);
+        r = _mm256_blendv_epi8(r, _mm256_or_si256(u, quiet), nan);
+        r = _mm256_srli_epi32(r, 16);
+        const __m128i h = _mm_packus_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+    }
+    narrow_bf16_scalar(src + i, dst + i, n - i);
+}
+
+// VCVTNEPS2BF16 rounds to nearest even too, but flushes subnormals to zero
+__attribute__((target("avx512f,avx512bf16")))
+void narrow_bf16_avx512(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+        const __m256bh h = _mm512_cvtneps_pbh(_mm512_loadu_ps(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), (__m256i)h);
+    }
+    narrow_bf16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx,f16c")))
+void widen_fp16_f16c(const uint16_t* src, float* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    widen_fp16_scalar(src + i, dst + i, n - i);
+}
+
+__attribute__((target("avx,f16c")))
+void narrow_fp16_f16c(const float* src, uint16_t* dst, size_t n) {
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+    narrow_fp16_scalar(src + i, dst + i, n - i);
+}
+#endif
+
+typedef void (*widen_fn)(const uint16_t* src, float* dst, size_t n);
+typedef void (*narrow_fn)(const float* src, uint16_t* dst, size_t n);
+
+inline void convert_row(const float* src, float* dst, size_t n) {
+    std::copy(src, src + n, dst);
+}
+
+void convert_row(const bf16* src, float* dst, size_t n) {
+#ifdef GEMM_X86
+    static const widen_fn fn = cpu_avx2() ? widen_bf16_avx2 : widen_bf16_scalar;
+#else
+    static const widen_fn fn = widen_bf16_scalar;
+#endif
+    fn(reinterpret_cast<const uint16_t*>(src), dst, n);
+}
+
+void convert_row(const float* src, bf16* dst, size_t n) {
+#ifdef GEMM_X86
+    static const narrow_fn fn = cpu_avx512bf16() ? narrow_bf16_avx512 :
+                                cpu_avx2()       ? narrow_bf16_avx2   : narrow_bf16_scalar;
+#else
+    static const narrow_fn fn = narrow_bf16_scalar;
+#endif
+    fn(src, reinterpret_cast<uint16_t*>(dst), n);
+}
+
+void convert_row(const fp16* src, float* dst, size_t n) {
+#ifdef GEMM_X86
+    static const widen_fn fn = cpu_f16c() ? widen_fp16_f16c : widen_fp16_scalar;
+#else
+    static const widen_fn fn = widen_fp16_scalar;
+#endif
+    fn(reinterpret_cast<const uint16_t*>(src), dst, n);
+}
+
+void convert_row(const float* src, fp16* dst, size_t n) {
+#ifdef GEMM_X86
+    static const narrow_fn fn = cpu_f16c() ? narrow_fp16_f16c : narrow_fp16_scalar;
+#else
+    static const narrow_fn fn = narrow_fp16_scalar;
+#endif
+    fn(src, reinterpret_cast<uint16_t*>(dst), n);
+}
+
+// dst = src, converting the element type
+template <typename S, typename D>
+void convert(Tensor2D<D>& dst, const Tensor2D<S>& src) {
+    dst.resize(src.rows(), src.cols());
+    for(size_t r = 0; r < src.rows(); ++r)
+        convert_row(src[r], dst[r], src.cols());
+}
+
+// ReLU activity of a layer's output, one bit per element, 64 per word
+typedef Tensor2D<uint64_t> Bitmask;
+
+inline size_t mask_words(size_t cols) {
+    return (cols + 63) / 64;
+}
+
+inline bool mask_bit(const Bitmask& mask, size_t r, size_t c) {
+    return (mask[r][c / 64] >> (c % 64)) & 1;
+}
+
+// Work done on each tile of C right after its last update, while the tile is
+// still in L1, in this order: broadcast-add a bias row, clamp at zero, zero
+// the elements whose bit is clear in mask_in, record which elements are
+// positive in mask_out, and add the column sums to colsum
+template <typename T>
+struct GemmEpilogue
+{
+    const T*        bias;
+    bool            relu;
+    const Bitmask*  mask_in;
+    Bitmask*        mask_out;
+    T*              colsum;
+
+    GemmEpilogue()
+        : bias(nullptr), relu(false), mask_in(nullptr), mask_out(nullptr),
+          colsum(nullptr) {}
+};
+
+// Apply ep to the mm x nn tile at c, whose top-left element is (row, col)
+// of the full product. A tile never straddles two mask words.
+template <typename T>
+void gemm_epilogue(const GemmEpilogue<T>& ep, T* c, size_t ldc,
+                   size_t row, size_t col, size_t mm, size_t nn) {
+    for(size_t i = 0; i < mm; ++i) {
+        T* const ci = c + i * ldc;
+        if(ep.bias)
+            for(size_t j = 0; j < nn; ++j) ci[j] += ep.bias[col + j];
+        if(ep.relu)
+            for(size_t j = 0; j < nn; ++j) ci[j] = ci[j] > 0 ? ci[j] : 0;
+        if(ep.mask_in) {
+            assert(col % 64 + nn <= 64);
+            const uint64_t bits = (*ep.mask_in)[row + i][col / 64] >> (col % 64);
+            for(size_t j = 0; j < nn; ++j)
+                ci[j] = (bits >> j) & 1 ? ci[j] : 0;
+        }
+        if(ep.mask_out) {
+            assert(col % 64 + nn <= 64);
+            uint64_t bits = 0;
+            for(size_t j = 0; j < nn; ++j)
+                bits |= (uint64_t)(ci[j] > 0) << j;
+            const size_t shift = col % 64;
+            const uint64_t keep = nn == 64 ? 0 : ~(((uint64_t(1) << nn) - 1) << shift);
+            uint64_t& word = (*ep.mask_out)[row + i][col / 64];
+            word = (word & keep) | (bits << shift);
+        }
+        if(ep.colsum)
+            for(size_t j = 0; j < nn; ++j) ep.colsum[col + j] += ci[j];
+    }
+}
+
+// Per-thread buffers holding the packed blocks, grown on demand and reused
+struct GemmScratch
+{
+    float* a;
+    float* b;
+    float* colsum;      // per row block column sums, on the calling thread
+    size_t asize, bsize, csize;
+
+    GemmScratch()
+        : a(nullptr), b(nullptr), colsum(nullptr), asize(0), bsize(0), csize(0) {}
+    ~GemmScratch() { free(a); free(b); free(colsum); }
+
+    static float* reserve(float*& p, size_t& have, size_t need) {
+        if(need > have) {
+            free(p);
+            p = static_cast<float*>(aligned_malloc(need * sizeof(float)));
+            have = need;
+        }
+        return p;
+    }
+};
+
+GemmScratch& gemm_scratch() {
+    static thread_local GemmScratch s;
+    return s;
+}
+
+// Elements of A as the kernels take them: bytes are widened to float and
+// multiplied by the operand's scale while packing, other types only widened
+template <typename TA>
+inline float gemm_elem(TA v, float) { return v; }
+inline float gemm_elem(uint8_t v, float scale) { return v * scale; }
+
+// Copy an m x k block of A into panels of mr rows, stored column by column,
+// zero-padding the last panel. With trans set, a holds A transposed (k x m).
+template <typename TA>
+void gemm_pack_a(bool trans, size_t m, size_t k, size_t mr,
+                 const TA* a, size_t lda, float scale, float* dst) {
+    for(size_t i0 = 0; i0 < m; i0 += mr) {
+        const size_t rows = min(mr, m - i0);
+        for(size_t p = 0; p < k; ++p, dst += mr) {
+            size_t i = 0;
+            if(trans) {
+                const TA* src = a + p * lda + i0;
+                for(; i < rows; ++i) dst[i] = gemm_elem(src[i], scale);
+            } else {
+                for(; i < rows; ++i) dst[i] = gemm_elem(a[(i0 + i) * lda + p], scale);
+            }
+            for(; i < mr; ++i) dst[i] = 0;
+        }
+    }
+}
+
+// Copy a k x n block of B into panels of nr columns, stored row by row,
+// zero-padding the last panel. With trans set, b holds B transposed (n x k).
+template <typename TB>
+void gemm_pack_b(bool trans, size_t k, size_t n, size_t nr,
+                 const TB* b, size_t ldb, float* dst) {
+    for(size_t j0 = 0; j0 < n; j0 += nr) {
+        const size_t cols = min(nr, n - j0);
+        if(trans) {
+            for(size_t j = 0; j < cols; ++j) {
+                const TB* src = b + (j0 + j) * ldb;
+                for(size_t p = 0; p < k; ++p) dst[p * nr + j] = src[p];
+            }
+            for(size_t p = 0; p < k; ++p)
+                for(size_t j = cols; j < nr; ++j) dst[p * nr + j] = 0;
+            dst += k * nr;
+            continue;
+        }
+        for(size_t p = 0; p < k; ++p, dst += nr) {
+            convert_row(b + p * ldb + j0, dst, cols);
+            for(size_t j = cols; j < nr; ++j) dst[j] = 0;
+        }
+    }
+}
+
+// Store the mm x nn tile of C at c, computed from kb columns of the packed
+// panels pa and pb, and apply ep to it if given. Float tiles are written in
+// place by the kernel; others are computed in tile and rounded as stored.
+inline void gemm_tile(const GemmKernel& kr, size_t kb, const float* pa, const float* pb,
+                      float* c, size_t ldc, size_t mm, size_t nn, bool acc,
+                      const GemmEpilogue<float>* ep, size_t row, size_t col, float* tile)
+{
+    const size_t nr = kr.nr;
+    if(mm == kr.mr && nn == nr) {
+        kr.run(kb, pa, pb, c, ldc, acc);
+    } else {
+        // Edge tile: compute the full tile aside, keep what fits
+        kr.run(kb, pa, pb, tile, nr, false);
+        for(size_t i = 0; i < mm; ++i)
+            for(size_t j = 0; j < nn; ++j)
+                c[i * ldc + j] = acc ? c[i * ldc + j] + tile[i * nr + j] : tile[i * nr + j];
+    }
+    if(ep) gemm_epilogue(*ep, c, ldc, row, col, mm, nn);
+}
+
+template <typename TC>
+void gemm_tile(const GemmKernel& kr, size_t kb, const float* pa, const float* pb,
+               TC* c, size_t ldc, size_t mm, size_t nn, bool acc,
+               const GemmEpilogue<float>* ep, size_t row, size_t col, float* tile)
+{
+    const size_t nr = kr.nr;
+    kr.run(kb, pa, pb, tile, nr, false);
+    if(acc)
+        for(size_t i = 0; i < mm; ++i)
+            for(size_t j = 0; j < nn; ++j) tile[i * nr + j] += c[i * ldc + j];
+    if(ep) gemm_epilogue(*ep, tile, nr, row, col, mm, nn);
+    for(size_t i = 0; i < mm; ++i)
+        convert_row(tile + i * nr, c + i * ldc, nn);
+}
+
+// Single-threaded GEMM over the block of C whose top-left element is
+// (row, col) of the full product. C in a 16 bit type is rounded only once:
+// its products are not split along k.
+template <typename TA, typename TB, typename TC>
+void gemm_block(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+                const TA* a, size_t lda, float a_scale, const TB* b, size_t ldb,
+                TC* c, size_t ldc, bool accumulate,
+                const GemmEpilogue<float>* ep, size_t row, size_t col, const GemmConfig& cfg)
+{
+    const GemmKernel& kr = *cfg.kernel;
+    const size_t mr = kr.mr, nr = kr.nr;
+    alignas(64) float tile[gemm_max_tile];
+
+    if(k == 0) {
+        for(size_t i = 0; i < m; i += mr)
+            for(size_t j = 0; j < n; j += nr) {
+                const size_t mm = min(mr, m - i), nn = min(nr, n - j);
+                std::fill(tile, tile + gemm_max_tile, 0.0f);
+                for(size_t ii = 0; ii < mm; ++ii)
+                    for(size_t jj = 0; jj < nn; ++jj)
+                        tile[ii * nr + jj] = accumulate ? (float)c[(i + ii) * ldc + j + jj] : 0.0f;
+                if(ep) gemm_epilogue(*ep, tile, nr, row + i, col + j, mm, nn);
+                for(size_t ii = 0; ii < mm; ++ii)
+                    convert_row(tile + ii * nr, c + (i + ii) * ldc + j, nn);
+            }
+        return;
+    }
+
+    GemmScratch& ws = gemm_scratch();
+    const size_t mc = min(cfg.mc, (m + mr - 1) / mr * mr);
+    const size_t kc = std::is_same<TC, float>::value ? min(cfg.kc, k) : k;
+    const size_t nc = min(cfg.nc, (n + nr - 1) / nr * nr);
+    float* const pa = GemmScratch::reserve(ws.a, ws.asize, mc * kc);
+    float* const pb = GemmScratch::reserve(ws.b, ws.bsize, kc * nc);
+
+    for(size_t jc = 0; jc < n; jc += nc) {
+        const size_t nb = min(nc, n - jc);
+        for(size_t pc = 0; pc < k; pc += kc) {
+            const size_t kb = min(kc, k - pc);
+            const bool acc = accumulate || pc > 0;
+            const bool last = pc + kb == k;
+            gemm_pack_b(trans_b, kb, nb, nr,
+                        trans_b ? b + jc * ldb + pc : b + pc * ldb + jc, ldb, pb);
+
+            for(size_t ic = 0; ic < m; ic += mc) {
+                const size_t mb = min(mc, m - ic);
+                gemm_pack_a(trans_a, mb, kb, mr,
+                            trans_a ? a + pc * lda + ic : a + ic * lda + pc, lda, a_scale, pa);
+
+                for(size_t jr = 0; jr < nb; jr += nr) {
+                    const size_t nn = min(nr, nb - jr);
+                    for(size_t ir = 0; ir < mb; ir += mr) {
+                        const size_t mm = min(mr, mb - ir);
+                        gemm_tile(kr, kb, pa + ir * kb, pb + jr * kb,
+                                  c + (ic + ir) * ldc + jc + jr, ldc, mm, nn, acc,
+                                  last ? ep : nullptr, row + ic + ir, col + jc + jr, tile);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// C[m x n] = (C +) a_scale * op(A)[m x k] * op(B)[k x n], where op()
+// transposes the operand when its flag is set. Leading dimensions are in
+// elements and refer to the operands as stored. A may hold bytes, and any
+// operand 16 bit floats, which are converted as they are packed or stored;
+// the products are always summed in float. C is cut into a grid of blocks,
+// one per thread, each computed with its own packing buffers. ep, if given,
+// is applied to the final values of C. cfg sets the kernel, the blocking and
+// how many threads may be used.
+template <typename TA, typename TB, typename TC>
+void gemm(const GemmConfig& cfg, bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          const TA* a, size_t lda, float a_scale, const TB* b, size_t ldb,
+          TC* c, size_t ldc, bool accumulate, const GemmEpilogue<float>* ep)
+{
+    const GemmKernel& kr = *cfg.kernel;
+    const size_t threads = cfg.threads ? min(cfg.threads, num_threads()) : num_threads();
+    const size_t mtiles = (m + kr.mr - 1) / kr.mr;
+    const size_t ntiles = (n + kr.nr - 1) / kr.nr;
+
+    // Small products are not worth waking the pool for
+    if(threads == 1 || (double)m * n * k < 64.0 * 64 * 64 || mtiles * ntiles < 2) {
+        gemm_block(trans_a, trans_b, m, n, k, a, lda, a_scale, b, ldb, c, ldc,
+                   accumulate, ep, 0, 0, cfg);
+        return;
+    }
+
+    // Column blocks must not share mask words between threads
+    const bool masked = ep && (ep->mask_out || ep->mask_in);
+    const size_t cunit = masked ? max<size_t>(kr.nr, 64) : kr.nr;
+    const size_t ctiles = (n + cunit - 1) / cunit;
+
+    // Pick the grid pr x pc, pr * pc <= threads, with the most squarely
+    // shaped blocks that keeps every thread busy
+    size_t pr = 1, pc = 1;
+    double best = -1;
+    for(size_t cols = 1; cols <= min(threads, ctiles); ++cols) {
+        const size_t rows = min(threads / cols, mtiles);
+        const double used = (double)(rows * cols) / threads;
+        const double bm = (double)m / rows, bn = (double)n / cols;
+        const double score = used * min(bm, bn) / max(bm, bn);
+        if(score > best) { best = score; pr = rows; pc = cols; }
+    }
+
+    // Row blocks sum their columns into their own row of partial sums,
+    // which are added up in a fixed order afterwards
+    float* partial = nullptr;
+    if(ep && ep->colsum) {
+        GemmScratch& ws = gemm_scratch();
+        partial = GemmScratch::reserve(ws.colsum, ws.csize, pr * n);
+    }
+
+    parallel_for(pr * pc, [&](size_t t) {
+        const size_t ri = t / pc, ci = t % pc;
+        const size_t i0 = mtiles * ri / pr * kr.mr;
+        const size_t i1 = min(m, mtiles * (ri + 1) / pr * kr.mr);
+        const size_t j0 = ctiles * ci / pc * cunit;
+        const size_t j1 = min(n, ctiles * (ci + 1) / pc * cunit);
+        if(j0 >= j1) return;
+        GemmEpilogue<float> block_ep;
+        const GemmEpilogue<float>* bep = ep;
+        if(partial) {
+            block_ep = *ep;
+            block_ep.colsum = partial + ri * n;
+            std::fill(block_ep.colsum + j0, block_ep.colsum + j1, 0.0f);
+            bep = &block_ep;
+        }
+        if(i0 >= i1) return;
+        gemm_block(trans_a, trans_b, i1 - i0, j1 - j0, k,
+                   trans_a ? a + i0 : a + i0 * lda, lda, a_scale,
+                   trans_b ? b + j0 * ldb : b + j0, ldb,
+                   c + i0 * ldc + j0, ldc, accumulate, bep, i0, j0, cfg);
+    });
+
+    if(partial)
+        for(size_t ri = 0; ri < pr; ++ri)
+            for(size_t j = 0; j < n; ++j)
+                ep->colsum[j] += partial[ri * n + j];
+}
+
+// The same with the configuration tuned for the shape, if any
+template <typename TA, typename TB, typename TC>
+void gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          const TA* a, size_t lda, float a_scale, const TB* b, size_t ldb,
+          TC* c, size_t ldc, bool accumulate, const GemmEpilogue<float>* ep)
+{
+    const GemmShape shape = { trans_a, trans_b, m, n, k };
+    gemm(gemm_config(shape), trans_a, trans_b, m, n, k, a, lda, a_scale, b, ldb, c, ldc,
+         accumulate, ep);
+}
+
+void gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          const float* a, size_t lda, const float* b, size_t ldb,
+          float* c, size_t ldc, bool accumulate = false,
+          const GemmEpilogue<float>* ep = nullptr)
+{
+    gemm(trans_a, trans_b, m, n, k, a, lda, 1.0f, b, ldb, c, ldc, accumulate, ep);
+}
+
+// Float A with B and C of any storage type
+template <typename TB, typename TC>
+void gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          const float* a, size_t lda, const TB* b, size_t ldb,
+          TC* c, size_t ldc, bool accumulate = false,
+          const GemmEpilogue<float>* ep = nullptr)
+{
+    gemm(trans_a, trans_b, m, n, k, a, lda, 1.0f, b, ldb, c, ldc, accumulate, ep);
+}
+
+// Reference implementation for non-float element types
+template<typename T>
+void gemm(bool trans_a, bool trans_b, size_t m, size_t n, size_t k,
+          const T* a, size_t lda, const T* b, size_t ldb,
+          T* c, size_t ldc, bool accumulate = false,
+          const GemmEpilogue<T>* ep = nullptr)
+{
+    for(size_t r = 0; r < m; ++r) {
+        T* const out = c + r * ldc;
+        if(!accumulate) std::fill(out, out + n, T(0));
+        for(size_t i = 0; i < k; ++i) {
+            const T v = trans_a ? a[i * lda + r] : a[r * lda + i];
+            for(size_t j = 0; j < n; ++j)
+                out[j] += v * (trans_b ? b[j * ldb + i] : b[i * ldb + j]);
+        }
+    }
+    if(ep)
+        for(size_t i = 0; i < m; ++i)
+            for(size_t j = 0; j < n; j += 64)
+                gemm_epilogue(*ep, c + i * ldc + j, ldc, i, j, 1, min<size_t>(64, n - j));
+}
+
+// out = (out +) op(left) * op(right) into an existing tensor, which is
+// resized to fit (without reallocating when it is large enough)
+template<typename T>
+void dot(Tensor2D<T>& out, const Tensor2D<T>& left, const Tensor2D<T>& right,
+         bool tleft = false, bool tright = false, bool accumulate = false)
+{
+    const size_t m = tleft  ? left.cols()  : left.rows();
+    const size_t k = tleft  ? left.rows()  : left.cols();
+    const size_t n = tright ? right.rows() : right.cols();
+    assert(k == (tright ? right.cols() : right.rows()) && msg2.c_str());
+    assert((!accumulate || (out.rows() == m && out.cols() == n)) && msg2.c_str());
+    out.resize(m, n);
+    gemm(tleft, tright, m, n, k, left.data(), left.stride(),
+         right.data(), right.stride(), out.data(), out.stride(), accumulate);
+}
+
+// dot() on operands of other types than out: bytes, which are multiplied
+// by scale as GEMM packs them, or 16 bit floats. No float copy is made.
+template <typename TA, typename TB>
+void dot(Tensor2D<float>& out, const Tensor2D<TA>& left, const Tensor2D<TB>& right,
+         bool tleft, bool tright, bool accumulate, float scale)
+{
+    const size_t m = tleft  ? left.cols()  : left.rows();
+    const size_t k = tleft  ? left.rows()  : left.cols();
+    const size_t n = tright ? right.rows() : right.cols();
+    assert(k == (tright ? right.cols() : right.rows()) && msg2.c_str());
+    assert((!accumulate || (out.rows() == m && out.cols() == n)) && msg2.c_str());
+    out.resize(m, n);
+    gemm(tleft, tright, m, n, k, left.data(), left.stride(), scale,
+         right.data(), right.stride(), out.data(), out.stride(), accumulate,
+         (const GemmEpilogue<float>*)nullptr);
+}
+
+// out = input * weights + bias, optionally followed by ReLU, as a single GEMM
+// whose epilogue adds the bias and clamps each tile while it is in cache.
+// mask, if given, records which outputs are positive.
+template<typename T>
+void linear(Tensor2D<T>& out, const Tensor2D<T>& input, const Tensor2D<T>& weights,
+            const Tensor2D<T>& bias, bool relu, Bitmask* mask = nullptr)
+{
+    assert(input.cols() == weights.rows() && msg2.c_str());
+    assert(bias.cols() == weights.cols());
+    out.resize(input.rows(), weights.cols());
+    if(mask) mask->resize(input.rows(), mask_words(weights.cols()));
+    GemmEpilogue<T> ep;
+    ep.bias = bias[0];
+    ep.relu = relu;
+    ep.mask_out = mask;
+    gemm(false, false, input.rows(), weights.cols(), input.cols(),
+         input.data(), input.stride(), weights.data(), weights.stride(),
+         out.data(), out.stride(), false, &ep);
+}
+
+// linear() with input, weights and out of their own types: a batch of raw
+// bytes, multiplied by scale while GEMM packs them so that it never exists
+// as floats, or 16 bit floats. Bias and sums are float.
+template <typename TO, typename TI, typename TW>
+void linear(Tensor2D<TO>& out, const Tensor2D<TI>& input, const Tensor2D<TW>& weights,
+            const Tensor2D<float>& bias, bool relu, Bitmask* mask, float scale)
+{
+    assert(input.cols() == weights.rows() && msg2.c_str());
+    assert(bias.cols() == weights.cols());
+    out.resize(input.rows(), weights.cols());
+    if(mask) mask->resize(input.rows(), mask_words(weights.cols()));
+    GemmEpilogue<float> ep;
+    ep.bias = bias[0];
+    ep.relu = relu;
+    ep.mask_out = mask;
+    gemm(false, false, input.rows(), weights.cols(), input.cols(),
+         input.data(), input.stride(), scale, weights.data(), weights.stride(),
+         out.data(), out.stride(), false, &ep);
+}
+
+// Gradient flowing back through a linear layer into the ReLU below it:
+// out = (grad * weights^T) zeroed where mask is clear, with the column sums
+// of out (the gradient of that layer's biases) added to colsum. One GEMM
+// pass, the masking and the reduction happening in its epilogue.
+template<typename T, typename TW>
+void linear_backward(Tensor2D<T>& out, const Tensor2D<T>& grad,
+                     const Tensor2D<TW>& weights, const Bitmask& mask, T* colsum)
+{
+    assert(grad.cols() == weights.cols() && msg2.c_str());
+    assert(mask.rows() == grad.rows() && mask.cols() == mask_words(weights.rows()));
+    out.resize(grad.rows(), weights.rows());
+    GemmEpilogue<T> ep;
+    ep.mask_in = &mask;
+    ep.colsum = colsum;
+    gemm(false, true, grad.rows(), weights.rows(), grad.cols(),
+         grad.data(), grad.stride(), weights.data(), weights.stride(),
+         out.data(), out.stride(), false, &ep);
+}
+
+// Dot product between Tensor2D objects. tleft/tright multiply by the
+// transpose of that operand without materialising it.
+template<typename T>
+Tensor2D<T> dot(const Tensor2D<T>& left, const Tensor2D<T>& right,
+                bool tleft = false, bool tright = false)
+{
+    Tensor2D<T> t(0, 0);
+    dot(t, left, right, tleft, tright);
+    return t;
+}
+
+// -----------------------------------------------------------------------------
+// GEMM autotuning
+// -----------------------------------------------------------------------------
+// The best kernel, blocking and thread count for a product depend on the CPU
+// and on the shape. gemm_autotune() times candidates for every shape given,
+// by coordinate descent from the defaults (kernel, then threads, kc, mc and
+// nc), and keeps the fastest for gemm() to use. Results are saved in a text
+// file, one line per shape, keyed by the CPU model and the number of
+// threads, so that later runs on the same kind of machine start tuned:
+//   <cpu model> \t <threads> \t <ta> <tb> <m> <n> <k> \t <kernel> <mc> <kc> <nc> <threads> <gflops>
+
+// CPU model as /proc/cpuinfo names it, tabs removed
+string cpu_model()
+{
+    ifstream in("/proc/cpuinfo");
+    string line;
+    while(getline(in, line)) {
+        const size_t colon = line.find(':');
+        if(line.compare(0, 10, "model name") != 0 || colon == string::npos) continue;
+        string model = line.substr(line.find_first_not_of(" \t", colon + 1));
+        std::replace(model.begin(), model.end(), '\t', ' ');
+        return model;
+    }
+    return "unknown";
+}
+
+// Read the entries of path for this machine into gemm_tuned(), replacing
+// those of the same shapes; returns how many were read
+size_t load_gemm_tuning(const string& path)
+{
+    ifstream in(path.c_str());
+    const string model = cpu_model();
+    vector<GemmTuned>& tuned = gemm_tuned();
+    string line;
+    size_t count = 0;
+    while(getline(in, line)) {
+        vector<string> fields;
+        istringstream split(line);
+        for(string field; getline(split, field, '\t'); ) fields.push_back(field);
+        if(fields.size() != 4 || fields[0] != model || atol(fields[1].c_str()) != (long)num_threads())
+            continue;
+        GemmTuned t;
+        int ta, tb;
+        char kernel[32];
+        if(sscanf(fields[2].c_str(), "%d %d %zu %zu %zu", &ta, &tb,
+                  &t.shape.m, &t.shape.n, &t.shape.k) != 5 ||
+           sscanf(fields[3].c_str(), "%31s %zu %zu %zu %zu %lf", kernel, &t.config.mc,
+                  &t.config.kc, &t.config.nc, &t.config.threads, &t.gflops) != 6)
+            continue;
+        t.shape.trans_a = ta;
+        t.shape.trans_b = tb;
+        t.config.kernel = nullptr;
+        for(size_t i = 0; i < num_gemm_kernels; ++i)
+            if(kernel == string(gemm_kernels[i].name) && gemm_kernels[i].supported())
+                t.config.kernel = &gemm_kernels[i];
+        if(!t.config.kernel || !t.config.mc || !t.config.kc || !t.config.nc) continue;
+        tuned.erase(std::remove_if(tuned.begin(), tuned.end(), [&](const GemmTuned& u) {
+            return gemm_same_class(u.shape, t.shape);
+        }), tuned.end());
+        tuned.push_back(t);
+        count++;
+    }
+    return count;
+}
+
+// Replace the entries of path for this machine by gemm_tuned(), keeping
+// those of other machines, through a temporary file renamed into place
+bool save_gemm_tuning(const string& path)
+{
+    const string model = cpu_model();
+    const string prefix = model + "\t" + to_string(num_threads()) + "\t";
+    vector<string> lines;
+    {
+        ifstream in(path.c_str());
+        string line;
+        while(getline(in, line))
+            if(line.compare(0, prefix.size(), prefix) != 0) lines.push_back(line);
+    }
+    const string tmp = path + ".tmp";
+    ofstream out(tmp.c_str());
+    for(size_t i = 0; i < lines.size(); ++i) out << lines[i] << "\n";
+    for(const GemmTuned& t : gemm_tuned()) {
+        out << prefix << t.shape.trans_a << " " << t.shape.trans_b << " " << t.shape.m << " ";
+        out << t.shape.n << " " << t.shape.k << "\t" << t.config.kernel->name << " ";
+        out << t.config.mc << " " << t.config.kc << " " << t.config.nc << " ";
+        out << t.config.threads << " " << fixed << setprecision(1) << t.gflops << "\n";
+    }
+    out.close();
+    if(!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// The fastest configuration found for shape, on float operands
+GemmTuned gemm_tune(const GemmShape& shape)
+{
+    const size_t m = shape.m, n = shape.n, k = shape.k;
+    Tensor2D<float> a(shape.trans_a ? k : m, shape.trans_a ? m : k);
+    Tensor2D<float> b(shape.trans_b ? n : k, shape.trans_b ? k : n);
+    Tensor2D<float> c(m, n);
+    for(size_t r = 0; r < a.rows(); ++r)
+        for(size_t j = 0; j < a.cols(); ++j) a[r][j] = (float)((r + j) % 7) - 3;
+    for(size_t r = 0; r < b.rows(); ++r)
+        for(size_t j = 0; j < b.cols(); ++j) b[r][j] = (float)((r * j) % 5) - 2;
+
+    // Best of two runs; the first also grows the packing buffers
+    auto seconds = [&](const GemmConfig& cfg) {
+        double best = 1e30;
+        for(size_t run = 0; run < 2; ++run) {
+            const auto t0 = std::chrono::steady_clock::now();
+            gemm(cfg, shape.trans_a, shape.trans_b, m, n, k, a.data(), a.stride(), 1.0f,
+                 b.data(), b.stride(), c.data(), c.stride(), false, (const GemmEpilogue<float>*)nullptr);
+            best = min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        }
+        return best;
+    };
+
+    GemmConfig best;
+    double best_time = seconds(best);
+    auto consider = [&](const GemmConfig& cfg) {
+        const double t = seconds(cfg);
+        if(t < best_time) { best_time = t; best = cfg; }
+    };
+
+    // The scalar kernel is only a fallback, not worth timing next to others
+    for(size_t i = 0; i + 1 < num_gemm_kernels; ++i)
+        if(gemm_kernels[i].supported() && &gemm_kernels[i] != best.kernel)
+            consider(GemmConfig(gemm_kernels[i]));
+
+    const GemmConfig from = best;
+    for(size_t t = 1; t < num_threads(); t *= 2) {
+        GemmConfig cfg = from;
+        cfg.threads = t;
+        consider(cfg);
+    }
+
+    const size_t kcs[] = { 128, 256, 384, 512, 1024 };
+    const GemmConfig kfrom = best;
+    for(size_t kc : kcs) {
+        GemmConfig cfg = kfrom;
+        cfg.kc = kc;
+        if(cfg.kc != kfrom.kc && kc < 2 * k) consider(cfg);
+    }
+
+    const size_t panels[] = { 4, 8, 16, 32, 64 };
+    const GemmConfig mfrom = best;
+    for(size_t p : panels) {
+        GemmConfig cfg = mfrom;
+        cfg.mc = p * cfg.kernel->mr;
+        if(cfg.mc != mfrom.mc && cfg.mc < 2 * m) consider(cfg);
+    }
+
+    const GemmConfig nfrom = best;
+    for(size_t p : panels) {
+        GemmConfig cfg = nfrom;
+        cfg.nc = 2 * p * cfg.kernel->nr;
+        if(cfg.nc != nfrom.nc && cfg.nc < 2 * n) consider(cfg);
+    }
+
+    GemmTuned tuned;
+    tuned.shape = shape;
+    tuned.config = best;
+    tuned.gflops = 2.0 * m * n * k / best_time / 1e9;
+    return tuned;
+}
+
+// Load the configurations saved in path for this machine, tune the shapes
+// that have none, and save them; returns how many shapes were tuned. Call
+// it before other threads start multiplying.
+size_t gemm_autotune(const vector<GemmShape>& shapes, const string& path)
+{
+    if(!path.empty()) load_gemm_tuning(path);
+    size_t count = 0;
+    for(const GemmShape& shape : shapes) {
+        bool known = false;
+        for(const GemmTuned& t : gemm_tuned()) known = known || gemm_same_class(t.shape, shape);
+        if(known) continue;
+        gemm_tuned().push_back(gemm_tune(shape));
+        count++;
+    }
+    if(count && !path.empty() && !save_gemm_tuning(path))
+        cerr << "could not write " << path << endl;
+    return count;
+}
+
+// -----------------------------------------------------------------------------
+// Sparse inputs
+// -----------------------------------------------------------------------------
+// Most MNIST pixels are zero. A batch whose density is low enough is also
+// kept in CSR form, and the first layer then does work only for nonzeros.
+
+// The nonzero bytes of a batch. Those of row r are cols[i], vals[i] for
+// rowptr[r] <= i < rowptr[r + 1]. Buffers only grow, so a reused object
+// stops allocating after the first few batches.
+struct SparseBytes
+{
+    vector<uint32_t> rowptr;
+    vector<uint16_t> cols;
+    vector<uint8_t>  vals;
+    size_t           ncols;
+
+    SparseBytes() : rowptr(1, 0), ncols(0) {}
+
+    size_t rows() const { return rowptr.size() - 1; }
+    size_t nnz() const  { return rowptr.back(); }
+
+    float density() const {
+        return rows() && ncols ? (float)nnz() / (rows() * ncols) : 1.0f;
+    }
+};
+
+// Build the CSR form of dense: count the nonzeros of every row, then fill
+// the rows in parallel at their offsets
+void to_sparse(SparseBytes& s, const Tensor2D<uint8_t>& dense) {
+    assert(dense.cols() <= 65536);
+    const size_t rows = dense.rows(), cols = dense.cols();
+    s.ncols = cols;
+    s.rowptr.resize(rows + 1);
+    s.rowptr[0] = 0;
+    parallel_range(rows, row_grain(cols), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const uint8_t* row = dense[r];
+            uint32_t n = 0;
+            for(size_t c = 0; c < cols; ++c) n += row[c] != 0;
+            s.rowptr[r + 1] = n;
+        }
+    });
+    for(size_t r = 0; r < rows; ++r)
+        s.rowptr[r + 1] += s.rowptr[r];
+    s.cols.resize(s.nnz());
+    s.vals.resize(s.nnz());
+    parallel_range(rows, row_grain(cols), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const uint8_t* row = dense[r];
+            size_t i = s.rowptr[r];
+            for(size_t c = 0; c < cols; ++c)
+                if(row[c]) { s.cols[i] = c; s.vals[i] = row[c]; i++; }
+        }
+    });
+}
+
+// Rows [r0, r1) of src, into dst's reused buffers
+void sparse_rows(SparseBytes& dst, const SparseBytes& src, size_t r0, size_t r1) {
+    const uint32_t first = src.rowptr[r0], last = src.rowptr[r1];
+    dst.ncols = src.ncols;
+    dst.rowptr.resize(r1 - r0 + 1);
+    for(size_t r = r0; r <= r1; ++r) dst.rowptr[r - r0] = src.rowptr[r] - first;
+    dst.cols.assign(src.cols.begin() + first, src.cols.begin() + last);
+    dst.vals.assign(src.vals.begin() + first, src.vals.begin() + last);
+}
+
+// Kernels over the nonzeros (cols[i], vals[i]), i < nnz, of one sparse row x,
+// with b and out of n columns:
+//   row:   out = scale * x * B, B with stride ldb
+//   outer: Out += scale * x^T * g, Out with stride ldo
+typedef void (*sparse_row_fn)(float* out, const uint16_t* cols, const uint8_t* vals,
+                              size_t nnz, float scale, const float* b, size_t ldb, size_t n);
+typedef void (*sparse_outer_fn)(float* out, size_t ldo, const uint16_t* cols,
+                                const uint8_t* vals, size_t nnz, float scale,
+                                const float* g, size_t n);
+
+void sparse_row_scalar(float* out, const uint16_t* cols, const uint8_t* vals,
+                       size_t nnz, float scale, const float* b, size_t ldb, size_t n) {
+    std::fill(out, out + n, 0.0f);
+    for(size_t i = 0; i < nnz; ++i) {
+        const float a = vals[i] * scale;
+        const float* bi = b + cols[i] * ldb;
+        for(size_t j = 0; j < n; ++j) out[j] += a * bi[j];
+    }
+}
+
+void sparse_outer_scalar(float* out, size_t ldo, const uint16_t* cols,
+                         const uint8_t* vals, size_t nnz, float scale,
+                         const float* g, size_t n) {
+    for(size_t i = 0; i < nnz; ++i) {
+        const float a = vals[i] * scale;
+        float* oi = out + cols[i] * ldo;
+        for(size_t j = 0; j < n; ++j) oi[j] += a * g[j];
+    }
+}
+
+#ifdef GEMM_X86
+// The vector kernels work on 64 columns at a time, keeping the sums (row) or
+// the slice of g (outer) in registers while going through the nonzeros. The
+// remaining columns are left to the scalar kernel.
+__attribute__((target("avx2,fma")))
+void sparse_row_avx2(float* out, const uint16_t* cols, const uint8_t* vals,
+                     size_t nnz, float scale, const float* b, size_t ldb, size_t n) {
+    size_t j0 = 0;
+    for(; j0 + 64 <= n; j0 += 64) {
+        __m256 acc[8];
+#pragma GCC unroll 8
+        for(size_t v = 0; v < 8; ++v) acc[v] = _mm256_setzero_ps();
+        for(size_t i = 0; i < nnz; ++i) {
+            const __m256 a = _mm256_set1_ps(vals[i] * scale);
+            const float* bi = b + cols[i] * ldb + j0;
+#pragma GCC unroll 8
+            for(size_t v = 0; v < 8; ++v)
+                acc[v] = _mm256_fmadd_ps(a, _mm256_loadu_ps(bi + 8 * v), acc[v]);
+        }
+#pragma GCC unroll 8
+        for(size_t v = 0; v < 8; ++v) _mm256_storeu_ps(out + j0 + 8 * v, acc[v]);
+    }
+    if(j0 < n) sparse_row_scalar(out + j0, cols, vals, nnz, scale, b + j0, ldb, n - j0);
+}
+
+__attribute__((target("avx2,fma")))
+void sparse_outer_avx2(float* out, size_t ldo, const uint16_t* cols,
+                       const uint8_t* vals, size_t nnz, float scale,
+                       const float* g, size_t n) {
+    size_t j0 = 0;
+    for(; j0 + 64 <= n; j0 += 64) {
+        __m256 gv[8];
+#pragma GCC unroll 8
+        for(size_t v = 0; v < 8; ++v) gv[v] = _mm256_loadu_ps(g + j0 + 8 * v);
+        for(size_t i = 0; i < nnz; ++i) {
+            const __m256 a = _mm256_set1_ps(vals[i] * scale);
+            float* oi = out + cols[i] * ldo + j0;
+#pragma GCC unroll 8
+            for(size_t v = 0; v < 8; ++v)
+                _mm256_storeu_ps(oi + 8 * v, _mm256_fmadd_ps(a, gv[v], _mm256_loadu_ps(oi + 8 * v)));
+        }
+    }
+    if(j0 < n) sparse_outer_scalar(out + j0, ldo, cols, vals, nnz, scale, g + j0, n - j0);
+}
+
+__attribute__((target("avx512f")))
+void sparse_row_avx512(float* out, const uint16_t* cols, const uint8_t* vals,
+                       size_t nnz, float scale, const float* b, size_t ldb, size_t n) {
+    size_t j0 = 0;
+    for(; j0 + 64 <= n; j0 += 64) {
+        __m512 acc[4];
+#pragma GCC unroll 4
+        for(size_t v = 0; v < 4; ++v) acc[v] = _mm512_setzero_ps();
+        for(size_t i = 0; i < nnz; ++i) {
+            const __m512 a = _mm512_set1_ps(vals[i] * scale);
+            const float* bi = b + cols[i] * ldb + j0;
+#pragma GCC unroll 4
+            for(size_t v = 0; v < 4; ++v)
+                acc[v] = _mm512_fmadd_ps(a, _mm512_loadu_ps(bi + 16 * v), acc[v]);
+        }
+#pragma GCC unroll 4
+        for(size_t v = 0; v < 4; ++v) _mm512_storeu_ps(out + j0 + 16 * v, acc[v]);
+    }
+    if(j0 < n) sparse_row_scalar(out + j0, cols, vals, nnz, scale, b + j0, ldb, n - j0);
+}
+
+__attribute__((target("avx512f")))
+void sparse_outer_avx512(float* out, size_t ldo, const uint16_t* cols,
+                         const uint8_t* vals, size_t nnz, float scale,
+                         const float* g, size_t n) {
+    size_t j0 = 0;
+    for(; j0 + 64 <= n; j0 += 64) {
+        __m512 gv[4];
+#pragma GCC unroll 4
+        for(size_t v = 0; v < 4; ++v) gv[v] = _mm512_loadu_ps(g + j0 + 16 * v);
+        for(size_t i = 0; i < nnz; ++i) {
+            const __m512 a = _mm512_set1_ps(vals[i] * scale);
+            float* oi = out + cols[i] * ldo + j0;
+#pragma GCC unroll 4
+            for(size_t v = 0; v < 4; ++v)
+                _mm512_storeu_ps(oi + 16 * v, _mm512_fmadd_ps(a, gv[v], _mm512_loadu_ps(oi + 16 * v)));
+        }
+    }
+    if(j0 < n) sparse_outer_scalar(out + j0, ldo, cols, vals, nnz, scale, g + j0, n - j0);
+}
+#endif
+
+struct SparseKernel
+{
+    const char*      name;
+    sparse_row_fn    row;
+    sparse_outer_fn  outer;
+    bool             (*supported)();
+};
+
+// Ordered from the most to the least preferred
+SparseKernel sparse_kernels[] = {
+#ifdef GEMM_X86
+    { "avx512", sparse_row_avx512, sparse_outer_avx512, cpu_avx512 },
+    { "avx2",   sparse_row_avx2,   sparse_outer_avx2,   cpu_avx2   },
+#endif
+    { "scalar", sparse_row_scalar, sparse_outer_scalar, cpu_any    },
+};
+const size_t num_sparse_kernels = sizeof(sparse_kernels) / sizeof(sparse_kernels[0]);
+
+SparseKernel* best_sparse_kernel() {
+    for(size_t i = 0; i < num_sparse_kernels; ++i)
+        if(sparse_kernels[i].supported()) return &sparse_kernels[i];
+    return &sparse_kernels[num_sparse_kernels - 1];
+}
+
+SparseKernel* active_sparse_kernel = best_sparse_kernel();
+
+bool set_sparse_kernel(const string& name) {
+    for(size_t i = 0; i < num_sparse_kernels; ++i)
+        if(name == sparse_kernels[i].name && sparse_kernels[i].supported()) {
+            active_sparse_kernel = &sparse_kernels[i];
+            return true;
+        }
+    return false;
+}
+
+// linear() with a sparse input: each output row adds up the weight rows of
+// the row's nonzeros. Rows are split across threads; bias, ReLU and the mask
+// go through the GEMM epilogue. Rows of a 16 bit out are summed in a float
+// row of the thread's and rounded once.
+template <typename TO>
+void linear(Tensor2D<TO>& out, const SparseBytes& input,
+            const Tensor2D<float>& weights, const Tensor2D<float>& bias,
+            bool relu, Bitmask* mask, float scale)
+{
+    assert(input.ncols == weights.rows() && msg2.c_str());
+    assert(bias.cols() == weights.cols());
+    const size_t n = weights.cols();
+    out.resize(input.rows(), n);
+    if(mask) mask->resize(input.rows(), mask_words(n));
+    GemmEpilogue<float> ep;
+    ep.bias = bias[0];
+    ep.relu = relu;
+    ep.mask_out = mask;
+    const sparse_row_fn row = active_sparse_kernel->row;
+    const bool narrow = !std::is_same<TO, float>::value;
+    parallel_range(input.rows(), row_grain(n), [&](size_t begin, size_t end) {
+        thread_local Tensor2D<float> scratch(1, 0);
+        if(narrow) scratch.resize(1, n);
+        for(size_t r = begin; r < end; ++r) {
+            float* const sums = narrow ? scratch[0] : reinterpret_cast<float*>(out[r]);
+            const size_t i = input.rowptr[r], nnz = input.rowptr[r + 1] - i;
+            row(sums, input.cols.data() + i, input.vals.data() + i, nnz, scale,
+                weights.data(), weights.stride(), n);
+            for(size_t j = 0; j < n; j += 64)
+                gemm_epilogue(ep, sums + j, n, r, j, 1, min<size_t>(64, n - j));
+            if(narrow) convert_row(sums, out[r], n);
+        }
+    });
+}
+
+// out = scale * S^T * right, the weight gradient of a layer with sparse
+// input S, as a sum of outer products of the rows of S and right. Threads
+// take slices of 64 columns of out, so no two write the same element and
+// the order of the sums does not depend on the thread count. With
+// accumulate set the products are added to out.
+void dot_sparse_t(Tensor2D<float>& out, const SparseBytes& left,
+                  const Tensor2D<float>& right, float scale, bool accumulate = false)
+{
+    assert(left.rows() == right.rows() && msg2.c_str());
+    assert((!accumulate || (out.rows() == left.ncols && out.cols() == right.cols())) && msg2.c_str());
+    const size_t n = right.cols();
+    out.resize(left.ncols, n);
+    const sparse_outer_fn outer = active_sparse_kernel->outer;
+    parallel_range((n + 63) / 64, 1, [&](size_t begin, size_t end) {
+        const size_t j0 = begin * 64, j1 = min(n, end * 64);
+        for(size_t r = 0; r < out.rows() && !accumulate; ++r)
+            std::fill(out[r] + j0, out[r] + j1, 0.0f);
+        for(size_t r = 0; r < left.rows(); ++r) {
+            const size_t i = left.rowptr[r], nnz = left.rowptr[r + 1] - i;
+            outer(out.data() + j0, out.stride(), left.cols.data() + i, left.vals.data() + i,
+                  nnz, scale, right[r] + j0, j1 - j0);
+        }
+    });
+}
+
+// Add Tensor2D objects, with broadcasting, into t (which may be left)
+template<typename T>
+void add(Tensor2D<T>& t, const Tensor2D<T>& left, const Tensor2D<T>& right)
+{
+    assert(left.cols() == right.cols());
+    assert((left.rows() == right.rows()) || (right.rows() == 1));
+    if(&t != &left) t.resize(left.rows(), left.cols());
+
+    parallel_range(left.rows(), row_grain(left.cols()), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const T* const l = left[r];
+            const T* const rr = right[right.rows() > 1 ? r : 0];
+            T* const out = t[r];
+            for(size_t c = 0; c < left.cols(); ++c)
+                out[c] = l[c] + rr[c];
+        }
+    });
+}
+
+// Add Tensor2D objects, with broadcasting
+template<typename T>
+Tensor2D<T> add(const Tensor2D<T>& left, const Tensor2D<T>& right)
+{
+    Tensor2D<T> t(0, 0);
+    add(t, left, right);
+    return t;
+}
+
+// Subtract Tensor2D objects, with broadcasting
+template<typename T>
+Tensor2D<T> sub(const Tensor2D<T>& left, const Tensor2D<T>& right)
+{
+    assert(left.cols() == right.cols());
+    assert((left.rows() == right.rows()) || (right.rows() == 1));
+    Tensor2D<T> t(left.rows(), left.cols());
+
+    parallel_range(left.rows(), row_grain(left.cols()), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const T* const l = left[r];
+            const T* const rr = right[right.rows() > 1 ? r : 0];
+            T* const out = t[r];
+            for(size_t c = 0; c < left.cols(); ++c)
+                out[c] = l[c] - rr[c];
+        }
+    });
+    return t;
+}
+
+// Multiply a Tensor2D object with a scalar float
+template<typename T>
+Tensor2D<T> mul(const Tensor2D<T>& left, float x)
+{
+    Tensor2D<T> t(left.rows(), left.cols());
+    const size_t stride = left.stride();
+    parallel_range(left.rows(), row_grain(stride), [&](size_t begin, size_t end) {
+        const T* const l = left[begin];
+        T* const out = t[begin];
+        for(size_t i = 0; i < (end - begin) * stride; ++i)
+            out[i] = l[i] * x;
+    });
+    return t;
+}
+
+// y += a * x, in place
+template<typename T>
+void axpy(Tensor2D<T>& y, float a, const Tensor2D<T>& x)
+{
+    assert(y.rows() == x.rows() && y.cols() == x.cols());
+    const size_t stride = y.stride();
+    parallel_range(y.rows(), row_grain(stride), [&](size_t begin, size_t end) {
+        const T* const in = x[begin];
+        T* const out = y[begin];
+        for(size_t i = 0; i < (end - begin) * stride; ++i)
+            out[i] += a * in[i];
+    });
+}
+
+// One SGD step with L2 regularisation, w -= lr * (g + reg * w), in a single
+// pass over w and g
+template<typename T>
+void sgd_update(Tensor2D<T>& w, const Tensor2D<T>& g, float lr, float reg)
+{
+    assert(w.rows() == g.rows() && w.cols() == g.cols());
+    const size_t stride = w.stride();
+    const float decay = 1.0f - lr * reg;
+    parallel_range(w.rows(), row_grain(stride), [&](size_t begin, size_t end) {
+        const T* const grad = g[begin];
+        T* const out = w[begin];
+        for(size_t i = 0; i < (end - begin) * stride; ++i)
+            out[i] = decay * out[i] - lr * grad[i];
+    });
+}
+
+// Transpose a Tensor2D object
+template<typename T>
+Tensor2D<T> transpose(const Tensor2D<T>& input)
+{
+    Tensor2D<T> t(input.cols(), input.rows());
+    parallel_range(input.cols(), row_grain(input.rows()), [&](size_t begin, size_t end) {
+        for(size_t r = 0; r < input.rows(); ++r) {
+            const T* const in = input[r];
+            for(size_t c = begin; c < end; ++c)
+                t[c][r] = in[c];
+        }
+    });
+    return t;
+}
+
+// -----------------------------------------------------------------------------
+// Loss function
+// -----------------------------------------------------------------------------
+
+template <typename T>
+T maxval(const T* const data, size_t count) {
+    T m = 0;
+    for(size_t i = 0; i < count; ++i)
+        if (data[i] > m) m = data[i];
+    return m;
+}
+
+template <typename T>
+size_t maxidx(const T* const data, size_t count) {
+    T m = 0;
+    size_t idx = -1;
+    for(size_t i = 0; i < count; ++i)
+        if (data[i] > m) { m = data[i]; idx = i; } 
+    return idx;
+}
+
+// Numerically stable softmax, into an existing tensor
+template <typename T>
+void softmax(Tensor2D<T>& t, const Tensor2D<T>& scores) {
+
+    t.resize(scores.rows(), scores.cols());
+
+    parallel_range(scores.rows(), row_grain(scores.cols()), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const T* const in = scores[r];
+            T* const out = t[r];
+            const T max = maxval(in, scores.cols());
+            T expsum = 0;
+            for(size_t c = 0; c < scores.cols(); ++c) {
+                out[c] = exp(in[c] - max);
+                expsum += out[c];
+            }
+            for(size_t c = 0; c < scores.cols(); ++c)
+                out[c] /= expsum;
+        }
+    });
+}
+
+template <typename T>
+Tensor2D<T> softmax(const Tensor2D<T>& scores) {
+    Tensor2D<T> t(0, 0);
+    softmax(t, scores);
+    return t;
+}
+
+// Log loss cross entropy
+template<typename T>
+float logloss(const Tensor2D<size_t>& actual, const Tensor2D<T>& prediction) {
+    float loss = 0.0;
+    assert(actual.rows() == prediction.rows());
+    for(size_t r = 0; r < actual.rows(); ++r) {
+        size_t idx = actual[r][0];
+        loss += -1.0 * log(prediction[r][idx]);
+    }
+    return loss / actual.rows();
+}
+
+// Row kernels for softmax with cross entropy. One call handles a row of n
+// scores x: out = (softmax(x) - onehot(label)) * scale, and the return value
+// is -log(softmax(x)[label]). With label == no_label, out is just softmax(x)
+// and 0 is returned. The SIMD versions evaluate exp with a polynomial.
+const size_t no_label = size_t(-1);
+
+typedef float (*softmax_row_fn)(const float* x, size_t n, float* out,
+                                size_t label, float scale);
+
+float softmax_row_scalar(const float* x, size_t n, float* out,
+                         size_t label, float scale) {
+    float max = x[0];
+    for(size_t c = 1; c < n; ++c) max = x[c] > max ? x[c] : max;
+    float sum = 0;
+    for(size_t c = 0; c < n; ++c) {
+        out[c] = exp(x[c] - max);
+        sum += out[c];
+    }
+    const float inv = scale / sum;
+    for(size_t c = 0; c < n; ++c) out[c] *= inv;
+    if(label == no_label) return 0;
+    out[label] -= scale;
+    return log(sum) - (x[label] - max);
+}
+
+#ifdef GEMM_X86
+// exp(x) for x <= 0, Cephes expf: 2^n * p(r) with r = x - n * ln(2)
+__attribute__((target("avx2,fma")))
+inline __m256 exp_avx2(__m256 x) {
+    x = _mm256_max_ps(x, _mm256_set1_ps(-87.3f));
+    const __m256 n = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504f),
+                                                     _mm256_set1_ps(0.5f)));
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), x);
+    __m256 y = _mm256_set1_ps(1.9875691500e-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073e-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894e-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459e-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201e-1f));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n),
+                                                         _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma")))
+float softmax_row_avx2(const float* x, size_t n, float* out,
+                       size_t label, float scale) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256 vmax = _mm256_set1_ps(-INFINITY);
+    for(size_t c = 0; c < n; c += 8) {
+        const __m256i m = _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n - c)), lane);
+        const __m256 v = _mm256_blendv_ps(vmax, _mm256_maskload_ps(x + c, m),
+                                          _mm256_castsi256_ps(m));
+        vmax = _mm256_max_ps(vmax, v);
+    }
+    vmax = _mm256_max_ps(vmax, _mm256_permute2f128_ps(vmax, vmax, 1));
+    vmax = _mm256_max_ps(vmax, _mm256_shuffle_ps(vmax, vmax, 0x4e));
+    vmax = _mm256_max_ps(vmax, _mm256_shuffle_ps(vmax, vmax, 0xb1));
+
+    __m256 vsum = _mm256_setzero_ps();
+    for(size_t c = 0; c < n; c += 8) {
+        const __m256i m = _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n - c)), lane);
+        __m256 e = exp_avx2(_mm256_sub_ps(_mm256_maskload_ps(x + c, m), vmax));
+        e = _mm256_and_ps(e, _mm256_castsi256_ps(m));
+        vsum = _mm256_add_ps(vsum, e);
+        _mm256_maskstore_ps(out + c, m, e);
+    }
+    vsum = _mm256_add_ps(vsum, _mm256_permute2f128_ps(vsum, vsum, 1));
+    vsum = _mm256_add_ps(vsum, _mm256_shuffle_ps(vsum, vsum, 0x4e));
+    vsum = _mm256_add_ps(vsum, _mm256_shuffle_ps(vsum, vsum, 0xb1));
+    const float sum = _mm256_cvtss_f32(vsum);
+
+    const __m256 inv = _mm256_set1_ps(scale / sum);
+    for(size_t c = 0; c < n; c += 8) {
+        const __m256i m = _mm256_cmpgt_epi32(_mm256_set1_epi32(int(n - c)), lane);
+        _mm256_maskstore_ps(out + c, m, _mm256_mul_ps(_mm256_maskload_ps(out + c, m), inv));
+    }
+    if(label == no_label) return 0;
+    out[label] -= scale;
+    return log(sum) - (x[label] - _mm256_cvtss_f32(vmax));
+}
+
+// GCC 12 warns about _mm512_undefined_ps() inside these intrinsics (PR105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+inline __m512 exp_avx512(__m512 x) {
+    x = _mm512_max_ps(x, _mm512_set1_ps(-87.3f));
+    const __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504f)),
+                                          _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+    x = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), x);
+    __m512 y = _mm512_set1_ps(1.9875691500e-4f);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073e-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894e-2f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459e-1f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201e-1f));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+    return _mm512_scalef_ps(y, n);
+}
+
+// Rows of up to 16 scores (10 for MNIST) stay in a single register
+__attribute__((target("avx512f")))
+float softmax_row_avx512(const float* x, size_t n, float* out,
+                         size_t label, float scale) {
+    if(n > 16) return softmax_row_avx2(x, n, out, label, scale);
+    const __mmask16 m = (__mmask16)((1u << n) - 1);
+    float max = x[0];
+    for(size_t c = 1; c < n; ++c) max = x[c] > max ? x[c] : max;
+    const __m512 v = _mm512_maskz_loadu_ps(m, x);
+    const __m512 e = _mm512_maskz_mov_ps(m, exp_avx512(_mm512_sub_ps(v, _mm512_set1_ps(max))));
+    alignas(64) float lanes[16];
+    _mm512_store_ps(lanes, e);
+    float sum = 0;
+    for(size_t c = 0; c < n; ++c) sum += lanes[c];
+    _mm512_mask_storeu_ps(out, m, _mm512_mul_ps(e, _mm512_set1_ps(scale / sum)));
+    if(label == no_label) return 0;
+    out[label] -= scale;
+    return log(sum) - (x[label] - max);
+}
+#pragma GCC diagnostic pop
+#endif
+
+struct SoftmaxKernel
+{
+    const char*     name;
+    softmax_row_fn  run;
+    bool            (*supported)();
+};
+
+// Ordered from the most to the least preferred
+SoftmaxKernel softmax_kernels[] = {
+#ifdef GEMM_X86
+    { "avx512", softmax_row_avx512, cpu_avx512 },
+    { "avx2",   softmax_row_avx2,   cpu_avx2   },
+#endif
+    { "scalar", softmax_row_scalar, cpu_any    },
+};
+const size_t num_softmax_kernels = sizeof(softmax_kernels) / sizeof(softmax_kernels[0]);
+
+SoftmaxKernel* best_softmax_kernel() {
+    for(size_t i = 0; i < num_softmax_kernels; ++i)
+        if(softmax_kernels[i].supported()) return &softmax_kernels[i];
+    return &softmax_kernels[num_softmax_kernels - 1];
+}
+
+SoftmaxKernel* active_softmax_kernel = best_softmax_kernel();
+
+bool set_softmax_kernel(const string& name) {
+    for(size_t i = 0; i < num_softmax_kernels; ++i)
+        if(name == softmax_kernels[i].name && softmax_kernels[i].supported()) {
+            active_softmax_kernel = &softmax_kernels[i];
+            return true;
+        }
+    return false;
+}
+
+// Fused softmax, cross entropy and its gradient: grad = (p - onehot) / N,
+// computed row by row while the scores are in registers. N is norm, or the
+// number of rows if 0. Returns the mean log loss of the batch.
+inline float softmax_xent(const Tensor2D<float>& scores, const Tensor2D<size_t>& actual,
+                          Tensor2D<float>& grad, size_t norm = 0) {
+    assert(actual.rows() == scores.rows());
+    grad.resize(scores.rows(), scores.cols());
+    const softmax_row_fn row = active_softmax_kernel->run;
+    const float scale = 1.0f / (norm ? norm : scores.rows());
+
+    // One partial loss per task, summed in order
+    const size_t max_tasks = 256;
+    double partial[max_tasks];
+    const size_t grain = row_grain(scores.cols());
+    const size_t tasks = max<size_t>(1, min(min(num_threads(), max_tasks), scores.rows() / grain));
+    parallel_for(tasks, [&](size_t t) {
+        double loss = 0;
+        for(size_t r = scores.rows() * t / tasks; r < scores.rows() * (t + 1) / tasks; ++r)
+            loss += row(scores[r], scores.cols(), grad[r], actual[r][0], scale);
+        partial[t] = loss;
+    });
+    double loss = 0;
+    for(size_t t = 0; t < tasks; ++t) loss += partial[t];
+    return loss / scores.rows();
+}
+
+inline void softmax(Tensor2D<float>& t, const Tensor2D<float>& scores) {
+    t.resize(scores.rows(), scores.cols());
+    const softmax_row_fn row = active_softmax_kernel->run;
+    parallel_range(scores.rows(), row_grain(scores.cols()), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r)
+            row(scores[r], scores.cols(), t[r], no_label, 1.0f);
+    });
+}
+
+// Index of the largest score of every row, i.e. the predicted class,
+// without computing the softmax
+template <typename T>
+void argmax(Tensor2D<size_t>& out, const Tensor2D<T>& scores) {
+    out.resize(scores.rows(), 1);
+    parallel_range(scores.rows(), row_grain(scores.cols()), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const T* const in = scores[r];
+            size_t idx = 0;
+            for(size_t c = 1; c < scores.cols(); ++c)
+                if(in[c] > in[idx]) idx = c;
+            out[r][0] = idx;
+        }
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Checkpoint files
+// -----------------------------------------------------------------------------
+// A checkpoint holds a list of 2D tensors, in native byte order:
+//   header   "MNISTCKP", uint32 version, uint32 tensor count, uint64 step
+//   entries  one per tensor: uint32 rows, cols, stride, element size;
+//            uint64 offset of its data from the start of the file
+//   data     each tensor at an offset that is a multiple of tensor_align,
+//            rows padded to stride elements, exactly as Tensor2D holds it
+// so that a mapped checkpoint can be used in place, without parsing or
+// copying the data.
+const char     checkpoint_magic[8] = { 'M', 'N', 'I', 'S', 'T', 'C', 'K', 'P' };
+const uint32_t checkpoint_version = 1;
+
+struct CheckpointHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t step;
+};
+
+struct CheckpointEntry
+{
+    uint32_t rows, cols, stride, elemsize;
+    uint64_t offset;
+};
+
+inline uint64_t checkpoint_align(uint64_t offset) {
+    return (offset + tensor_align - 1) / tensor_align * tensor_align;
+}
+
+// Write tensors to path, through a temporary file renamed into place, so
+// that readers see either the previous checkpoint or the whole new one
+template <typename T>
+void save_checkpoint(const string& path, const vector<const Tensor2D<T>*>& tensors,
+                     uint64_t step)
+{
+    CheckpointHeader header;
+    memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = checkpoint_version;
+    header.count = tensors.size();
+    header.step = step;
+    vector<CheckpointEntry> entries(tensors.size());
+    uint64_t offset = checkpoint_align(sizeof(header) + entries.size() * sizeof(CheckpointEntry));
+    for(size_t i = 0; i < tensors.size(); ++i) {
+        const Tensor2D<T>& t = *tensors[i];
+        entries[i].rows = t.rows();
+        entries[i].cols = t.cols();
+        entries[i].stride = t.stride();
+        entries[i].elemsize = sizeof(T);
+        entries[i].offset = offset;
+        offset = checkpoint_align(offset + t.rows() * t.stride() * sizeof(T));
+    }
+
+    const string tmp = path + ".tmp";
+    ofstream out(tmp.c_str(), ios::binary | ios::trunc);
+    const char zeros[tensor_align] = {};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(CheckpointEntry));
+    uint64_t pos = sizeof(header) + entries.size() * sizeof(CheckpointEntry);
+    for(size_t i = 0; i < tensors.size(); ++i) {
+        out.write(zeros, entries[i].offset - pos);
+        const size_t bytes = tensors[i]->rows() * tensors[i]->stride() * sizeof(T);
+        out.write(reinterpret_cast<const char*>(tensors[i]->data()), bytes);
+        pos = entries[i].offset + bytes;
+    }
+    out.close();
+    if(!out || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        throw runtime_error(msg6.c_str());
+    }
+}
+
+// A checkpoint file mapped into memory. Its tensors are handed out as
+// views of the mapping, valid as long as the Checkpoint: pages are read on
+// first access and may be written to without changing the file, though
+// every view of the same tensor sees the change.
+class Checkpoint
+{
+    public:
+        explicit Checkpoint(const string& path)
+            : _map(MAP_FAILED), _size(0) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if(fd < 0) throw runtime_error(msg3.c_str());
+            struct stat st;
+            if(fstat(fd, &st) == 0 && st.st_size > 0) {
+                _size = st.st_size;
+                _map = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            }
+            close(fd);
+            if(_map == MAP_FAILED) throw runtime_error(msg3.c_str());
+            parse();
+        }
+
+        ~Checkpoint() {
+            munmap(_map, _size);
+        }
+
+        size_t   size() const { return _entries.size(); }
+        uint64_t step() const { return _step; }
+
+        // Tensor i, in place
+        template <typename T>
+        Tensor2D<T> view(size_t i) const {
+            const CheckpointEntry& e = _entries[i];
+            if(e.elemsize != sizeof(T)) throw runtime_error(msg5.c_str());
+            Tensor2D<T> t = Tensor2D<T>::view(reinterpret_cast<T*>(static_cast<char*>(_map) + e.offset),
+                                              e.rows, e.cols);
+            if(t.stride() != e.stride) throw runtime_error(msg5.c_str());
+            return t;
+        }
+
+    private:
+        void*                   _map;
+        size_t                  _size;
+        uint64_t                _step;
+        vector<CheckpointEntry> _entries;
+
+        Checkpoint(const Checkpoint&) = delete;
+        Checkpoint& operator=(const Checkpoint&) = delete;
+
+        void parse() {
+            CheckpointHeader header;
+            if(_size < sizeof(header)) invalid();
+            memcpy(&header, _map, sizeof(header));
+            if(memcmp(header.magic, checkpoint_magic, sizeof(header.magic)) != 0 ||
+               header.version != checkpoint_version ||
+               (_size - sizeof(header)) / sizeof(CheckpointEntry) < header.count)
+                invalid();
+            _step = header.step;
+            _entries.resize(header.count);
+            memcpy(_entries.data(), static_cast<char*>(_map) + sizeof(header),
+                   header.count * sizeof(CheckpointEntry));
+            // Sizes are bounded by dividing, so that no product of the
+            // 32-bit fields can wrap
+            for(const CheckpointEntry& e : _entries) {
+                const uint64_t row_bytes = (uint64_t)e.stride * e.elemsize;
+                if(e.offset % tensor_align || e.offset > _size || e.cols > e.stride ||
+                   e.elemsize == 0 || row_bytes % tensor_align ||
+                   (row_bytes && e.rows > (_size - e.offset) / row_bytes))
+                    invalid();
+            }
+        }
+
+        void invalid() {
+            munmap(_map, _size);
+            throw runtime_error(msg5.c_str());
+        }
+};
+
+// -----------------------------------------------------------------------------
+// Neural Network
+// -----------------------------------------------------------------------------
+
+// ReLU activation function (modified the input, taken as reference)
+template <typename T>
+void relu(Tensor2D<T>& input) {
+    const size_t stride = input.stride();
+    parallel_range(input.rows(), row_grain(stride), [&](size_t begin, size_t end) {
+        T* const data = input[begin];
+        for(size_t i = 0; i < (end - begin) * stride; i++)
+            if(data[i] <= 0.0) data[i] = 0.0;
+    });
+}
+
+// The weights a layer computes with: a copy of its master weights rounded
+// to S, refreshed by sync(), or the master weights themselves when S is T
+template <typename T, typename S>
+struct StoredWeights
+{
+    StoredWeights() : copy(0, 0) {}
+    const Tensor2D<S>& get(const Tensor2D<T>&) const { return copy; }
+    void sync(const Tensor2D<T>& master) { convert(copy, master); }
+    void share(StoredWeights& other) {
+        copy = Tensor2D<S>::view(other.copy.data(), other.copy.rows(), other.copy.cols());
+    }
+
+    Tensor2D<S> copy;
+};
+
+template <typename T>
+struct StoredWeights<T, T>
+{
+    const Tensor2D<T>& get(const Tensor2D<T>& master) const { return master; }
+    void sync(const Tensor2D<T>&) {}
+    void share(StoredWeights&) {}
+};
+
+// Linear layer. Its weights, biases and gradients are T; forward() uses
+// the weights as stored in S. Call sync() after changing the weights.
+template <typename T, typename S = T>
+class Linear 
+{
+    public:
+        explicit Linear(size_t in, size_t out, bool add_relu = true)
+            : weights(in, out), biases(1, out), weights_grad(in, out),
+              biases_grad(1, out), add_relu(add_relu) {
+                init();
+                sync();
+        }
+
+        // A layer with the given parameters, which may be views
+        explicit Linear(Tensor2D<T>&& w, Tensor2D<T>&& b, bool add_relu = true)
+            : weights(std::move(w)), biases(std::move(b)),
+              weights_grad(weights.rows(), weights.cols()),
+              biases_grad(1, weights.cols()), add_relu(add_relu) {
+                sync();
+        }
+
+        // Compute the layer's output into a caller-owned tensor, and which
+        // of its outputs are active into mask. Inputs of raw bytes are
+        // multiplied by scale.
+        template <typename TI, typename TO>
+        void forward(const Tensor2D<TI>& input, Tensor2D<TO>& out,
+                     Bitmask* mask = nullptr, float scale = 1) const {
+            PROFILE_SCOPE(phase_linear, 2.0 * input.rows() * weights.rows() * weights.cols(),
+                          (double)input.rows() * (input.cols() * sizeof(TI) + weights.cols() * sizeof(TO))
+                              + (double)weights.rows() * weights.cols() * sizeof(S),
+                          input.rows());
+            linear(out, input, stored(), biases, add_relu, mask, scale);
+        }
+
+        // The same on a batch of raw bytes given as its nonzeros, which
+        // are summed from the master weights
+        template <typename TO>
+        void forward(const SparseBytes& input, Tensor2D<TO>& out,
+                     Bitmask* mask, float scale) const {
+            PROFILE_SCOPE(phase_linear, 2.0 * input.nnz() * weights.cols(),
+                          3.0 * input.nnz() + (double)input.rows() * weights.cols() * sizeof(TO)
+                              + (double)weights.rows() * weights.cols() * sizeof(T),
+                          input.rows());
+            linear(out, input, weights, biases, add_relu, mask, scale);
+        }
+
+        template <typename TI>
+        Tensor2D<T> eval(const Tensor2D<TI>& input) const {
+            Tensor2D<T> scores(0, 0);
+            forward(input, scores);
+            return scores;
+        }
+
+        void clear() {
+            weights_grad.fill(0.0);
+            biases_grad.fill(0.0);
+        }
+
+        const Tensor2D<S>& stored() const { return _stored.get(weights); }
+        void sync() { _stored.sync(weights); }
+
+        // Compute with the weights and biases of other, and its stored
+        // weights, in place rather than with copies of them
+        void share(Linear& other) {
+            weights = Tensor2D<T>::view(other.weights.data(), other.weights.rows(), other.weights.cols());
+            biases = Tensor2D<T>::view(other.biases.data(), other.biases.rows(), other.biases.cols());
+            _stored.share(other._stored);
+        }
+
+        Tensor2D<T> weights;
+        Tensor2D<T> biases;
+        Tensor2D<T> weights_grad;
+        Tensor2D<T> biases_grad;
+
+    private:
+        bool add_relu;
+        StoredWeights<T, S> _stored;
+
+        void init() {
+            for(size_t i = 0; i < weights.rows(); ++i)
+                for(size_t j = 0; j < weights.cols(); ++j)
+                    weights[i][j] = genrand();
+            for(size_t i = 0; i < biases.rows(); ++i)
+                for(size_t j = 0; j < biases.cols(); ++j)
+                    biases[i][j] = 0.001;
+        }
+};
+
+// Activations and gradients of one forward/backward pass. They are
+// allocated once, for the largest batch, and reused by every step. The
+// hidden activations are kept in S, the scores and gradients in T.
+template <typename T, typename S = T>
+struct Workspace
+{
+    explicit Workspace(size_t batch, size_t out, size_t h1, size_t h2)
+        : acts1(batch, h1), acts2(batch, h2), scores(batch, out),
+          mask1(batch, mask_words(h1)),
+          mask2(batch, mask_words(h2)), grad3(batch, out), grad2(batch, h2),
+          grad1(batch, h1) {
+    }
+
+    Tensor2D<S> acts1, acts2;                   // hidden layer outputs
+    Tensor2D<T> scores;                         // last layer output
+    Bitmask     mask1, mask2;                   // ReLU activity of layer1/2
+    Tensor2D<T> grad3, grad2, grad1;            // loss wrt layer outputs
+};
+
+// How the first layer ran on the last batch
+struct InputPath
+{
+    bool    sparse_forward; // sparse kernels were used for the forward pass
+    bool    sparse_grad;    // and for the weight gradient
+    float   density;        // fraction of nonzero inputs, 1 if unknown
+    double  seconds;        // layer1 forward and weight gradient
+    double  speedup;        // estimated all-dense time over seconds
+
+    InputPath()
+        : sparse_forward(false), sparse_grad(false), density(1), seconds(0),
+          speedup(1) {}
+};
+
+// The Network. Its parameters and gradients are T; S is the type its
+// weights and activations are stored in during the forward and backward
+// passes, e.g. bf16 or fp16 for half the memory traffic. Products are
+// summed in float either way.
+template <typename T, typename S = T>
+class Network
+{
+    public:
+        // Inputs are either T or raw bytes, which are multiplied by
+        // input_scale as the first layer reads them
+        explicit Network(size_t in, size_t out, size_t h1, size_t h2,
+                         size_t max_batch = batch_size, float input_scale = pixel_scale)
+            : layer1(in, h1), layer2(h1, h2), layer3(h2, out, false),
+              ws(max_batch, out, h1, h2), byte_scale(input_scale), probes(0) {
+            std::fill(&rate[0][0], &rate[0][0] + 4, 0.0);
+        }
+
+        // A copy of the parameters of other, with room for batches of max_batch
+        explicit Network(const Network& other, size_t max_batch)
+            : layer1(other.layer1), layer2(other.layer2), layer3(other.layer3),
+              ws(max_batch, other.layer3.weights.cols(), other.layer1.weights.cols(),
+                 other.layer2.weights.cols()),
+              byte_scale(other.byte_scale), probes(0) {
+            std::fill(&rate[0][0], &rate[0][0] + 4, 0.0);
+        }
+
+        // The network saved in ckpt, without initialising it first. With
+        // map set its parameters are used in place, as in load().
+        explicit Network(const Checkpoint& ckpt, bool map = true,
+                         size_t max_batch = batch_size, float input_scale = pixel_scale)
+            : layer1(param(ckpt, 0, map), param(ckpt, 1, map)),
+              layer2(param(ckpt, 2, map), param(ckpt, 3, map)),
+              layer3(param(ckpt, 4, map), param(ckpt, 5, map), false),
+              ws(max_batch, layer3.weights.cols(), layer1.weights.cols(), layer2.weights.cols()),
+              byte_scale(input_scale), probes(0) {
+            std::fill(&rate[0][0], &rate[0][0] + 4, 0.0);
+            for(const Linear<T, S>* l : { &layer1, &layer2, &layer3 })
+                if(l->biases.rows() != 1 || l->biases.cols() != l->weights.cols())
+                    throw runtime_error(msg5.c_str());
+            if(layer2.weights.rows() != layer1.weights.cols() ||
+               layer3.weights.rows() != layer2.weights.cols())
+                throw runtime_error(msg5.c_str());
+        }
+
+        // Take over the weights and biases of other, of the same shape,
+        // without allocating
+        void copy_params(const Network& other) {
+            layer1.weights = other.layer1.weights;
+            layer2.weights = other.layer2.weights;
+            layer3.weights = other.layer3.weights;
+            layer1.biases = other.layer1.biases;
+            layer2.biases = other.layer2.biases;
+            layer3.biases = other.layer3.biases;
+            sync();
+        }
+
+        // From now on compute with the parameters of other, of the same
+        // shape, rather than with a copy: its steps and sync() are seen here
+        // at no cost. other must not move its parameters, e.g. by load()
+        // with map set, while this uses them.
+        void share_params(Network& other) {
+            layer1.share(other.layer1);
+            layer2.share(other.layer2);
+            layer3.share(other.layer3);
+        }
+
+        // Returns the scores of the last layer (before softmax), valid
+        // until the next forward(). sparse, if given, is the CSR form of
+        // input; layer1 uses it when the batch is sparse enough.
+        template <typename TI>
+        const Tensor2D<T>& forward(const Tensor2D<TI>& input,
+                                   const SparseBytes* sparse = nullptr) {
+            PROFILE_SCOPE(phase_forward, 2.0 * input.rows() * macs(), 0, input.rows());
+            path.density = sparse ? sparse->density() : 1;
+            path.seconds = 0;
+            probing = path.density < sparse_density && probes < sparse_probes;
+            path.sparse_forward = run_input_op(0, input.rows(),
+                [&] { input_forward(input, ws.acts1, &ws.mask1); },
+                [&] { input_forward(input, ws.acts1, &ws.mask1, sparse); });
+            layer2.forward(ws.acts1, ws.acts2, &ws.mask2);
+            layer3.forward(ws.acts2, ws.scores);
+            return ws.scores;
+        }
+
+        // Softmax probabilities
+        template <typename TI>
+        Tensor2D<T> eval(const Tensor2D<TI>& input) const {
+            Tensor2D<S> acts1(0, 0), acts2(0, 0);
+            input_forward(input, acts1);
+            layer2.forward(acts1, acts2);
+            return softmax(layer3.eval(acts2));
+        }
+
+        // Predicted class of every row of input, no softmax needed
+        template <typename TI>
+        void predict(const Tensor2D<TI>& input, Tensor2D<size_t>& classes) const {
+            Tensor2D<S> acts1(0, 0), acts2(0, 0);
+            input_forward(input, acts1);
+            layer2.forward(acts1, acts2);
+            argmax(classes, layer3.eval(acts2));
+        }
+
+        // Gradients for the batch last passed to forward(), returns its loss.
+        // They are averaged over norm rows, by default those of the batch.
+        // The weight gradients replace the previous ones, unless accumulate
+        // is set; the bias gradients are always added to theirs.
+        template <typename TI>
+        float backward(const Tensor2D<size_t>& actual, const Tensor2D<TI>& input,
+                       const SparseBytes* sparse = nullptr, size_t norm = 0,
+                       bool accumulate = false) {
+            // The weight gradients of all layers, the gradients flowing
+            // back of the upper two
+            PROFILE_SCOPE(phase_backward, 2.0 * input.rows() * (2 * macs() - layer1.weights.rows()
+                                                                * layer1.weights.cols()),
+                          0, input.rows());
+
+            // Softmax, loss and its gradient in one pass
+            Tensor2D<T>& sm = ws.grad3;
+            const float loss = softmax_xent(ws.scores, actual, sm, norm);
+
+            // Backprop through layer3 
+            dot(layer3.weights_grad, ws.acts2, sm, true, false, accumulate, 1.0f);
+            for(size_t r = 0; r < sm.rows(); ++r)
+                for(size_t c = 0; c < sm.cols(); ++c)
+                    layer3.biases_grad[0][c] += sm[r][c];
+
+            // Backprop through layer2, the ReLU mask and the bias gradient
+            // are applied within the same pass
+            Tensor2D<T>& hidden2 = ws.grad2;
+            linear_backward(hidden2, sm, layer3.stored(), ws.mask2, layer2.biases_grad[0]);
+            dot(layer2.weights_grad, ws.acts1, hidden2, true, false, accumulate, 1.0f);
+
+            // Backprop through layer1 
+            Tensor2D<T>& hidden1 = ws.grad1;
+            linear_backward(hidden1, hidden2, layer2.stored(), ws.mask1, layer1.biases_grad[0]);
+            // Probing runs both paths, which must not both add to the gradient
+            if(accumulate) probing = false;
+            path.sparse_grad = run_input_op(1, input.rows(),
+                [&] { input_grad(input, hidden1, nullptr, accumulate); },
+                [&] { input_grad(input, hidden1, sparse, accumulate); });
+            if(probing) probes++;
+            path.speedup = (rate[0][0] + rate[1][0]) * input.rows() / path.seconds;
+            return loss;
+        }
+
+        // The path layer1 took on the last forward()/backward()
+        const InputPath& input_path() const { return path; }
+
+        // Gradients of a whole batch, computed micro rows at a time: each
+        // micro-batch runs forward() and backward() on views of its rows,
+        // accumulating into the gradients, so only micro rows of
+        // activations are live at once. The gradients equal those of one
+        // pass over the batch, up to rounding. Returns the mean loss.
+        template <typename TI>
+        float gradients(const Tensor2D<TI>& input, const Tensor2D<size_t>& actual,
+                        const SparseBytes* sparse = nullptr, size_t micro = 0) {
+            const size_t rows = input.rows();
+            if(!micro || micro >= rows) {
+                forward(input, sparse);
+                return backward(actual, input, sparse);
+            }
+            double loss = 0;
+            for(size_t r0 = 0; r0 < rows; r0 += micro) {
+                const size_t n = min(micro, rows - r0);
+                const Tensor2D<TI> in = Tensor2D<TI>::view(const_cast<TI*>(input[r0]), n, input.cols());
+                const Tensor2D<size_t> labels =
+                    Tensor2D<size_t>::view(const_cast<size_t*>(actual[r0]), n, 1);
+                if(sparse) sparse_rows(micro_sparse, *sparse, r0, r0 + n);
+                forward(in, sparse ? &micro_sparse : nullptr);
+                loss += (double)backward(labels, in, sparse ? &micro_sparse : nullptr, rows, r0 > 0) * n;
+            }
+            return loss / rows;
+        }
+
+        // Weight regularisation is applied here, together with the step,
+        // rather than being added to weights_grad in backward(). The step
+        // is taken on the master weights, which are then stored again.
+        void opt(float lr=learn_rate, float reg=wt_reg) {
+            // Read weights and gradients, write weights, clear gradients
+            PROFILE_SCOPE(phase_opt, 3.0 * macs(), 4.0 * sizeof(T) * macs());
+            sgd_update(layer1.weights, layer1.weights_grad, lr, reg);
+            sgd_update(layer2.weights, layer2.weights_grad, lr, reg);
+            sgd_update(layer3.weights, layer3.weights_grad, lr, reg);
+
+            sgd_update(layer1.biases, layer1.biases_grad, lr, 0);
+            sgd_update(layer2.biases, layer2.biases_grad, lr, 0);
+            sgd_update(layer3.biases, layer3.biases_grad, lr, 0);
+
+            sync();
+            clear();
+        }
+
+        // Add the gradients of other, of the same shape, to ours
+        void add_grads(const Network& other) {
+            axpy(layer1.weights_grad, 1, other.layer1.weights_grad);
+            axpy(layer2.weights_grad, 1, other.layer2.weights_grad);
+            axpy(layer3.weights_grad, 1, other.layer3.weights_grad);
+            axpy(layer1.biases_grad, 1, other.layer1.biases_grad);
+            axpy(layer2.biases_grad, 1, other.layer2.biases_grad);
+            axpy(layer3.biases_grad, 1, other.layer3.biases_grad);
+        }
+
+        // Zero the gradients; bias gradients accumulate until this is done
+        void clear() {
+            layer1.clear();
+            layer2.clear();
+            layer3.clear();
+        }
+
+        // The products of a training step on batches of rows: the forward
+        // pass, the weight gradients and the gradients flowing back
+        vector<GemmShape> gemm_shapes(size_t rows) const {
+            vector<GemmShape> shapes;
+            const Linear<T, S>* layers[] = { &layer1, &layer2, &layer3 };
+            for(size_t i = 0; i < 3; ++i) {
+                const size_t in = layers[i]->weights.rows(), out = layers[i]->weights.cols();
+                shapes.push_back(GemmShape{ false, false, rows, out, in });
+                shapes.push_back(GemmShape{ true, false, in, out, rows });
+                if(i) shapes.push_back(GemmShape{ false, true, rows, in, out });
+            }
+            return shapes;
+        }
+
+        // The weights and biases of every layer, in checkpoint order
+        vector<const Tensor2D<T>*> params() const {
+            vector<const Tensor2D<T>*> p;
+            for(const Linear<T, S>* l : { &layer1, &layer2, &layer3 }) {
+                p.push_back(&l->weights);
+                p.push_back(&l->biases);
+            }
+            return p;
+        }
+
+        void save(const string& path, uint64_t step = 0) const {
+            PROFILE_SCOPE(phase_checkpoint, 0, (double)sizeof(T) * macs());
+            save_checkpoint(path, params(), step);
+        }
+
+        // Take the parameters from ckpt, which must be of a network of the
+        // same shape. With map set they are used in place, views of the
+        // mapped file, so nothing is read before it is needed; ckpt must
+        // then outlive the network, or its next load().
+        void load(const Checkpoint& ckpt, bool map = false) {
+            if(ckpt.size() != 6) throw runtime_error(msg5.c_str());
+            size_t i = 0;
+            for(Linear<T, S>* l : { &layer1, &layer2, &layer3 }) {
+                load(l->weights, ckpt, i++, map);
+                load(l->biases, ckpt, i++, map);
+            }
+            sync();
+        }
+
+        // Layer i, 0 to 2, and what raw byte inputs are multiplied by
+        const Linear<T, S>& layer(size_t i) const {
+            return i == 0 ? layer1 : i == 1 ? layer2 : layer3;
+        }
+        float input_scale() const { return byte_scale; }
+
+    private:
+        Linear<T, S> layer1;
+        Linear<T, S> layer2;
+        Linear<T, S> layer3;
+        Workspace<T, S> ws;
+        float byte_scale;
+        InputPath path;
+        double rate[2][2];      // seconds per row of [forward, grad][dense, sparse]
+        size_t probes;          // batches on which both paths were timed
+        bool probing;
+        SparseBytes micro_sparse;   // the rows of a micro-batch
+
+        static const size_t sparse_probes = 2;
+
+        template <typename F>
+        static double timed(const F& fn) {
+            const auto t0 = std::chrono::steady_clock::now();
+            fn();
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        }
+
+        // Run operation op of layer1 (0 the forward pass, 1 the weight
+        // gradient) on the dense or the sparse input. The first sparse
+        // batches run both, the sparse one last, to time them; later ones
+        // use whichever was faster. Returns whether the sparse one ran.
+        template <typename D, typename SP>
+        bool run_input_op(size_t op, size_t rows, const D& dense, const SP& sparse) {
+            double& dt = rate[op][0];
+            double& st = rate[op][1];
+            if(probing) {
+                dt = timed(dense) / rows;
+                st = timed(sparse) / rows;
+                path.seconds += st * rows;
+                return true;
+            }
+            const bool use = path.density < sparse_density && st < dt;
+            const double t = use ? timed(sparse) : timed(dense);
+            (use ? st : dt) = t / rows;
+            path.seconds += t;
+            return use;
+        }
+
+        static Tensor2D<T> param(const Checkpoint& ckpt, size_t i, bool map) {
+            if(ckpt.size() != 6) throw runtime_error(msg5.c_str());
+            Tensor2D<T> v = ckpt.view<T>(i);
+            return map ? std::move(v) : Tensor2D<T>(v);
+        }
+
+        static void load(Tensor2D<T>& t, const Checkpoint& ckpt, size_t i, bool map) {
+            Tensor2D<T> v = ckpt.view<T>(i);
+            if(v.rows() != t.rows() || v.cols() != t.cols())
+                throw runtime_error(msg5.c_str());
+            if(map) t = std::move(v);
+            else    t = v;
+        }
+
+        // Weights of all layers, i.e. multiply-adds per row of input
+        double macs() const {
+            double n = 0;
+            for(const Linear<T, S>* l : { &layer1, &layer2, &layer3 })
+                n += (double)l->weights.rows() * l->weights.cols();
+            return n;
+        }
+
+        // Refresh the stored weights from the master ones
+        void sync() {
+            layer1.sync();
+            layer2.sync();
+            layer3.sync();
+        }
+
+        // layer1 and its weight gradient, for either kind of input. Bytes
+        // may come with their nonzeros, which are used instead when given.
+        void input_forward(const Tensor2D<T>& input, Tensor2D<S>& out,
+                           Bitmask* mask = nullptr, const SparseBytes* sparse = nullptr) const {
+            assert(!sparse);
+            layer1.forward(input, out, mask);
+        }
+
+        void input_forward(const Tensor2D<uint8_t>& input, Tensor2D<S>& out,
+                           Bitmask* mask = nullptr, const SparseBytes* sparse = nullptr) const {
+            if(sparse) layer1.forward(*sparse, out, mask, byte_scale);
+            else       layer1.forward(input, out, mask, byte_scale);
+        }
+
+        void input_grad(const Tensor2D<T>& input, const Tensor2D<T>& grad,
+                        const SparseBytes* sparse, bool accumulate) {
+            assert(!sparse);
+            dot(layer1.weights_grad, input, grad, true, false, accumulate, 1.0f);
+        }
+
+        void input_grad(const Tensor2D<uint8_t>& input, const Tensor2D<T>& grad,
+                        const SparseBytes* sparse, bool accumulate) {
+            if(sparse) dot_sparse_t(layer1.weights_grad, *sparse, grad, byte_scale, accumulate);
+            else       dot(layer1.weights_grad, input, grad, true, false, accumulate, byte_scale);
+        }
+
+};
+
+// A fully connected layer of a Sequential, with In inputs and Out outputs.
+// All but the last layer of a Sequential are followed by ReLU.
+template <size_t In, size_t Out>
+struct Dense
+{
+    static constexpr size_t inputs()  { return In; }
+    static constexpr size_t outputs() { return Out; }
+    static constexpr size_t params()  { return In * Out + Out; }
+};
+
+// The layers of a Sequential from the first of Layers on, each with its
+// activations and gradients for batches of up to max_batch rows. Each one
+// holds the rest in next, so calls through the stack are resolved, and
+// inlined, at compile time.
+template <typename T, typename... Layers>
+class Stages;
+
+// Past the last layer: softmax and cross entropy, whose gradient goes to
+// the last layer
+template <typename T>
+class Stages<T>
+{
+    public:
+        explicit Stages(size_t) {}
+
+        static constexpr size_t depth()       { return 0; }
+        static constexpr size_t inputs()      { return 0; }
+        static constexpr size_t outputs()     { return 0; }
+        static constexpr size_t params()      { return 0; }
+        static constexpr size_t activations() { return 0; }
+
+        const Tensor2D<T>& forward(const Tensor2D<T>& scores, float) { return scores; }
+
+        float backward(const Tensor2D<size_t>& actual, size_t norm,
+                       const Tensor2D<T>& scores, float, Tensor2D<T>* grad,
+                       const Bitmask*, T* bias_grad) {
+            const float loss = softmax_xent(scores, actual, *grad, norm);
+            for(size_t r = 0; r < grad->rows(); ++r)
+                for(size_t c = 0; c < grad->cols(); ++c)
+                    bias_grad[c] += (*grad)[r][c];
+            return loss;
+        }
+
+        void opt(float, float) {}
+        void clear() {}
+};
+
+template <typename T, typename L, typename... Rest>
+class Stages<T, L, Rest...>
+{
+    typedef Stages<T, Rest...> Next;
+    static constexpr bool last = sizeof...(Rest) == 0;
+    static_assert(last || Next::inputs() == L::outputs(),
+                  "each layer's inputs must match the outputs of the one before");
+
+    public:
+        explicit Stages(size_t max_batch)
+            : layer_(L::inputs(), L::outputs(), !last),
+              acts(max_batch, L::outputs()), grad(max_batch, L::outputs()),
+              mask(max_batch, mask_words(L::outputs())), next(max_batch) {
+        }
+
+        static constexpr size_t depth()   { return 1 + Next::depth(); }
+        static constexpr size_t inputs()  { return L::inputs(); }
+        static constexpr size_t outputs() { return last ? L::outputs() : Next::outputs(); }
+        static constexpr size_t params()  { return L::params() + Next::params(); }
+        // Floats of activations per row of a batch
+        static constexpr size_t activations() { return L::outputs() + Next::activations(); }
+
+        // The scores of the last layer for input, multiplied by scale
+        template <typename TI>
+        const Tensor2D<T>& forward(const Tensor2D<TI>& input, float scale) {
+            layer_.forward(input, acts, last ? nullptr : &mask, scale);
+            return next.forward(acts, 1);
+        }
+
+        // Gradients of this layer and those after it for the input of the
+        // last forward(), and into below the gradient of the layer before,
+        // masked by its ReLU, whose bias gradient is added to below_bias
+        template <typename TI>
+        float backward(const Tensor2D<size_t>& actual, size_t norm,
+                       const Tensor2D<TI>& input, float scale, Tensor2D<T>* below,
+                       const Bitmask* below_mask, T* below_bias) {
+            const float loss = next.backward(actual, norm, acts, 1, &grad, &mask,
+                                             layer_.biases_grad[0]);
+            dot(layer_.weights_grad, input, grad, true, false, false, scale);
+            if(below) linear_backward(*below, grad, layer_.weights, *below_mask, below_bias);
+            return loss;
+        }
+
+        void opt(float lr, float reg) {
+            sgd_update(layer_.weights, layer_.weights_grad, lr, reg);
+            sgd_update(layer_.biases, layer_.biases_grad, lr, 0);
+            next.opt(lr, reg);
+        }
+
+        void clear() {
+            layer_.clear();
+            next.clear();
+        }
+
+        Linear<T>& layer(size_t i) { return layer(i, std::integral_constant<bool, last>()); }
+
+    private:
+        Linear<T>   layer_;
+        Tensor2D<T> acts, grad;         // output, loss wrt output
+        Bitmask     mask;               // ReLU activity of acts
+        Next        next;
+
+        Linear<T>& layer(size_t, std::true_type) { return layer_; }
+        Linear<T>& layer(size_t i, std::false_type) { return i ? next.layer(i - 1) : layer_; }
+};
+
+// A network of Dense layers whose widths are known at compile time, e.g.
+// Sequential<float, Dense<784, 512>, Dense<512, 10> >. Layers that do not
+// fit together fail to compile. It trains like Network, without the sparse
+// input path.
+template <typename T, typename... Layers>
+class Sequential
+{
+    static_assert(sizeof...(Layers) > 0, "a Sequential needs at least one layer");
+    typedef Stages<T, Layers...> Stack;
+
+    public:
+        // Inputs are either T or raw bytes, which are multiplied by
+        // input_scale as the first layer reads them
+        explicit Sequential(size_t max_batch = batch_size, float input_scale = pixel_scale)
+            : stack(max_batch), byte_scale(input_scale) {
+        }
+
+        static constexpr size_t depth()       { return Stack::depth(); }
+        static constexpr size_t inputs()      { return Stack::inputs(); }
+        static constexpr size_t outputs()     { return Stack::outputs(); }
+        static constexpr size_t params()      { return Stack::params(); }
+        static constexpr size_t activations() { return Stack::activations(); }
+
+        // Returns the scores of the last layer (before softmax), valid
+        // until the next forward()
+        template <typename TI>
+        const Tensor2D<T>& forward(const Tensor2D<TI>& input) {
+            assert(input.cols() == inputs() && msg2.c_str());
+            return stack.forward(input, scale(input));
+        }
+
+        void predict(const Tensor2D<uint8_t>& input, Tensor2D<size_t>& classes) {
+            argmax(classes, forward(input));
+        }
+
+        // Gradients for the batch last passed to forward(), returns its loss.
+        // They are averaged over norm rows, by default those of the batch.
+        template <typename TI>
+        float backward(const Tensor2D<size_t>& actual, const Tensor2D<TI>& input,
+                       size_t norm = 0) {
+            return stack.backward(actual, norm, input, scale(input), nullptr, nullptr, nullptr);
+        }
+
+        void opt(float lr=learn_rate, float reg=wt_reg) {
+            stack.opt(lr, reg);
+            clear();
+        }
+
+        void clear() { stack.clear(); }
+
+        // Layer i, 0 to depth() - 1
+        Linear<T>& layer(size_t i) {
+            assert(i < depth());
+            return stack.layer(i);
+        }
+
+    private:
+        Stack stack;
+        float byte_scale;
+
+        float scale(const Tensor2D<uint8_t>&) const { return byte_scale; }
+        float scale(const Tensor2D<T>&) const { return 1; }
+};
+
+// The network of mnist(), sized at compile time
+typedef Sequential<precision, Dense<pixels, 512>, Dense<512, 1024>, Dense<1024, 10> > MNISTNetwork;
+
+// Synchronous data-parallel training. Each batch is split into row shards,
+// one per replica, whose gradients are computed concurrently and summed
+// into the network's own, ready for a single opt(). The network itself is
+// replica 0. The others compute with its parameters in place, through
+// share_params(), and have their own activations and gradients. Each shard
+// takes its rows of the batch's sparse form, if given.
+//
+// With deterministic set the gradients are summed pairwise along a fixed
+// binary tree, each level in parallel, so the result does not depend on
+// timing. Otherwise every replica adds its gradients into the network as
+// soon as both are done, in whatever order they finish.
+template <typename T, typename S = T, typename TI = uint8_t>
+class DataParallel
+{
+    public:
+        explicit DataParallel(Network<T, S>& net, size_t replicas,
+                              size_t max_batch = batch_size,
+                              bool deterministic = deterministic_reduce)
+            : _net(net), _deterministic(deterministic),
+              _loss(max<size_t>(replicas, 1)), _net_done(false) {
+            const size_t shard = (max_batch + _loss.size() - 1) / _loss.size();
+            for(size_t k = 1; k < _loss.size(); ++k) {
+                _replicas.push_back(unique_ptr<Network<T, S> >(new Network<T, S>(net, shard)));
+                _replicas.back()->share_params(net);
+            }
+            for(size_t k = 0; k < _loss.size(); ++k) {
+                _inputs.push_back(Tensor2D<TI>(0, 0));
+                _labels.push_back(Tensor2D<size_t>(0, 0));
+            }
+            _sparse.resize(_loss.size());
+        }
+
+        size_t replicas() const { return _loss.size(); }
+
+        // Forward and backward passes over the batch, leaving its gradients
+        // in the network. sparse, if given, is the CSR form of input.
+        // Returns the mean loss.
+        float gradients(const Tensor2D<TI>& input, const Tensor2D<size_t>& actual,
+                        const SparseBytes* sparse = nullptr) {
+            const size_t rows = input.rows(), n = replicas();
+            _net_done = false;
+            _waiting.clear();
+            parallel_for(n, [&](size_t k) {
+                const size_t r0 = rows * k / n, r1 = rows * (k + 1) / n;
+                Network<T, S>& net = replica(k);
+                slice(_inputs[k], input, r0, r1);
+                slice(_labels[k], actual, r0, r1);
+                if(sparse) sparse_rows(_sparse[k], *sparse, r0, r1);
+                const SparseBytes* shard = sparse ? &_sparse[k] : nullptr;
+                net.forward(_inputs[k], shard);
+                _loss[k] = (double)net.backward(_labels[k], _inputs[k], shard, rows) * (r1 - r0);
+                if(!_deterministic) arrive(k);
+            });
+            if(_deterministic) reduce();
+
+            double loss = 0;
+            for(size_t k = 0; k < n; ++k) loss += _loss[k];
+            return loss / rows;
+        }
+
+    private:
+        Network<T, S>&                     _net;
+        vector<unique_ptr<Network<T, S> > > _replicas;    // 1 .. replicas() - 1
+        vector<Tensor2D<TI> >           _inputs;
+        vector<Tensor2D<size_t> >       _labels;
+        vector<SparseBytes>             _sparse;
+        bool                            _deterministic;
+        vector<double>                  _loss;          // per replica, times its rows
+        mutex                           _mutex;
+        bool                            _net_done;      // replica 0 has its gradients
+        vector<size_t>                  _waiting;       // finished before replica 0
+
+        Network<T, S>& replica(size_t k) { return k ? *_replicas[k - 1] : _net; }
+
+        static void slice(Tensor2D<TI>& dst, const Tensor2D<TI>& src, size_t r0, size_t r1) {
+            dst.resize(r1 - r0, src.cols());
+            for(size_t r = r0; r < r1; ++r)
+                std::copy(src[r], src[r] + src.cols(), dst[r - r0]);
+        }
+
+        static void slice(Tensor2D<size_t>& dst, const Tensor2D<size_t>& src, size_t r0, size_t r1) {
+            dst.resize(r1 - r0, 1);
+            for(size_t r = r0; r < r1; ++r)
+                dst[r - r0][0] = src[r][0];
+        }
+
+        // Levels of the tree: replica i takes in i + step, for i a multiple
+        // of 2 * step
+        void reduce() {
+            const size_t n = replicas();
+            for(size_t step = 1; step < n; step *= 2) {
+                const size_t pairs = (n - step + 2 * step - 1) / (2 * step);
+                parallel_for(pairs, [&](size_t p) {
+                    const size_t i = p * 2 * step;
+                    replica(i).add_grads(replica(i + step));
+                    replica(i + step).clear();
+                });
+            }
+        }
+
+        // Replica 0 overwrites its weight gradients in backward(), so the
+        // others wait for it before adding theirs
+        void arrive(size_t k) {
+            lock_guard<mutex> lk(_mutex);
+            if(k == 0) {
+                _net_done = true;
+                for(size_t i = 0; i < _waiting.size(); ++i) take(_waiting[i]);
+                _waiting.clear();
+            } else if(_net_done) {
+                take(k);
+            } else {
+                _waiting.push_back(k);
+            }
+        }
+
+        void take(size_t k) {
+            _net.add_grads(replica(k));
+            replica(k).clear();
+        }
+};
+
+// -----------------------------------------------------------------------------
+// Quantized inference
+// -----------------------------------------------------------------------------
+// Post-training int8 quantization of a trained Network, for inference only.
+// Weights are rounded to int8 with one scale per output column; inputs and
+// hidden activations, all nonnegative, to 7 bit unsigned values with one
+// scale per tensor, calibrated on a sample of the data. Products are summed
+// in int32 and scaled back to float only in the epilogue, which also adds
+// the bias and applies ReLU before requantizing for the next layer.
+//
+// 7 bits keep the sum of two products within int16, so AVX2's saturating
+// vpmaddubsw computes exactly what VNNI's vpdpbusd does: every kernel gives
+// the same result.
+
+const size_t qgemm_nr = 16;         // columns per packed weight panel
+const size_t qgemm_max_mr = 8;
+const int    quant_max = 127;
+
+// Kernels compute an mr x 16 tile of int32 sums for mr rows of activations,
+// read 4 bytes at a time, with one panel of weights, stored as groups of 4
+// consecutive k of each of its 16 columns: 64 bytes per group of k.
+typedef void (*qgemm_fn)(const uint8_t* const* rows, const int8_t* panel,
+                         size_t groups, int32_t* tile);
+
+template <size_t mr>
+void qgemm_scalar(const uint8_t* const* rows, const int8_t* panel,
+                  size_t groups, int32_t* tile) {
+    std::fill(tile, tile + mr * qgemm_nr, 0);
+    for(size_t g = 0; g < groups; ++g, panel += 4 * qgemm_nr)
+        for(size_t i = 0; i < mr; ++i) {
+            const uint8_t* a = rows[i] + 4 * g;
+            for(size_t j = 0; j < qgemm_nr; ++j)
+                for(size_t p = 0; p < 4; ++p)
+                    tile[i * qgemm_nr + j] += (int32_t)a[p] * panel[4 * j + p];
+        }
+}
+
+#ifdef GEMM_X86
+inline int32_t qgemm_group(const uint8_t* a) {
+    int32_t v;
+    memcpy(&v, a, 4);
+    return v;
+}
+
+__attribute__((target("avx2")))
+void qgemm_avx2(const uint8_t* const* rows, const int8_t* panel,
+                size_t groups, int32_t* tile) {
+    const size_t mr = 4;
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc[mr][2];
+    for(size_t i = 0; i < mr; ++i) acc[i][0] = acc[i][1] = _mm256_setzero_si256();
+    for(size_t g = 0; g < groups; ++g, panel += 4 * qgemm_nr) {
+        const __m256i w0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(panel));
+        const __m256i w1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(panel + 32));
+        for(size_t i = 0; i < mr; ++i) {
+            const __m256i a = _mm256_set1_epi32(qgemm_group(rows[i] + 4 * g));
+            acc[i][0] = _mm256_add_epi32(acc[i][0], _mm256_madd_epi16(_mm256_maddubs_epi16(a, w0), ones));
+            acc[i][1] = _mm256_add_epi32(acc[i][1], _mm256_madd_epi16(_mm256_maddubs_epi16(a, w1), ones));
+        }
+    }
+    for(size_t i = 0; i < mr; ++i) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + i * qgemm_nr), acc[i][0]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + i * qgemm_nr + 8), acc[i][1]);
+    }
+}
+
+__attribute__((target("avx2,avxvnni")))
+void qgemm_avxvnni(const uint8_t* const* rows, const int8_t* panel,
+                   size_t groups, int32_t* tile) {
+    const size_t mr = 6;
+    __m256i acc[mr][2];
+    for(size_t i = 0; i < mr; ++i) acc[i][0] = acc[i][1] = _mm256_setzero_si256();
+    for(size_t g = 0; g < groups; ++g, panel += 4 * qgemm_nr) {
+        const __m256i w0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(panel));
+        const __m256i w1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(panel + 32));
+        for(size_t i = 0; i < mr; ++i) {
+            const __m256i a = _mm256_set1_epi32(qgemm_group(rows[i] + 4 * g));
+            acc[i][0] = _mm256_dpbusd_avx_epi32(acc[i][0], a, w0);
+            acc[i][1] = _mm256_dpbusd_avx_epi32(acc[i][1], a, w1);
+        }
+    }
+    for(size_t i = 0; i < mr; ++i) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + i * qgemm_nr), acc[i][0]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(tile + i * qgemm_nr + 8), acc[i][1]);
+    }
+}
+
+__attribute__((target("avx512f,avx512vnni")))
+void qgemm_avx512vnni(const uint8_t* const* rows, const int8_t* panel,
+                      size_t groups, int32_t* tile) {
+    const size_t mr = 8;
+    __m512i acc[mr];
+    for(size_t i = 0; i < mr; ++i) acc[i] = _mm512_setzero_si512();
+    for(size_t g = 0; g < groups; ++g, panel += 4 * qgemm_nr) {
+        const __m512i w = _mm512_load_si512(panel);
+        for(size_t i = 0; i < mr; ++i)
+            acc[i] = _mm512_dpbusd_epi32(acc[i], _mm512_set1_epi32(qgemm_group(rows[i] + 4 * g)), w);
+    }
+    for(size_t i = 0; i < mr; ++i)
+        _mm512_storeu_si512(tile + i * qgemm_nr, acc[i]);
+}
+#endif
+
+struct QGemmKernel
+{
+    const char* name;
+    size_t      mr;         // rows per call
+    qgemm_fn    run;
+    bool        (*supported)();
+};
+
+// Ordered from the most to the least preferred
+QGemmKernel qgemm_kernels[] = {
+#ifdef GEMM_X86
+    { "avx512vnni", 8, qgemm_avx512vnni, cpu_avx512vnni },
+    { "avxvnni",    6, qgemm_avxvnni,    cpu_avxvnni    },
+    { "avx2",       4, qgemm_avx2,       cpu_avx2       },
+#endif
+    { "scalar",     4, qgemm_scalar<4>,  cpu_any        },
+};
+const size_t num_qgemm_kernels = sizeof(qgemm_kernels) / sizeof(qgemm_kernels[0]);
+
+QGemmKernel* best_qgemm_kernel() {
+    for(size_t i = 0; i < num_qgemm_kernels; ++i)
+        if(qgemm_kernels[i].supported()) return &qgemm_kernels[i];
+    return &qgemm_kernels[num_qgemm_kernels - 1];
+}
+
+QGemmKernel* active_qgemm_kernel = best_qgemm_kernel();
+
+bool set_qgemm_kernel(const string& name) {
+    for(size_t i = 0; i < num_qgemm_kernels; ++i)
+        if(name == qgemm_kernels[i].name && qgemm_kernels[i].supported()) {
+            active_qgemm_kernel = &qgemm_kernels[i];
+            return true;
+        }
+    return false;
+}
+
+// Raw bytes 0 .. 255 as 7 bit values, dropping their lowest bit
+void quantize_bytes(Tensor2D<uint8_t>& out, const Tensor2D<uint8_t>& in) {
+    out.resize(in.rows(), in.cols());
+    parallel_range(in.rows(), row_grain(in.cols()), [&](size_t begin, size_t end) {
+        for(size_t r = begin; r < end; ++r) {
+            const uint8_t* src = in[r];
+            uint8_t* dst = out[r];
+            for(size_t c = 0; c < in.cols(); ++c) dst[c] = src[c] >> 1;
+        }
+    });
+}
+
+// An int8 copy of a Linear layer. Its input comes quantized with in_scale;
+// its output is either float, or ReLU'd and quantized with out_scale.
+class QuantLinear
+{
+    public:
+        template <typename T, typename S>
+        QuantLinear(const Linear<T, S>& layer, bool relu, float in_scale, float out_scale)
+            : _in(layer.weights.rows()), _out(layer.weights.cols()),
+              _groups((_in + 3) / 4), _panels((_out + qgemm_nr - 1) / qgemm_nr),
+              _packed(_panels * _groups, 4 * qgemm_nr),
+              _scale(_panels * qgemm_nr, 0.0f), _bias(_panels * qgemm_nr, 0.0f),
+              _relu(relu), _inv_out(out_scale > 0 ? 1 / out_scale : 0) {
+            for(size_t j = 0; j < _out; ++j) {
+                float wmax = 0;
+                for(size_t k = 0; k < _in; ++k) wmax = max(wmax, fabsf(layer.weights[k][j]));
+                const float ws = wmax > 0 ? wmax / quant_max : 1;
+                _scale[j] = in_scale * ws;
+                _bias[j] = layer.biases[0][j];
+                int8_t* dst = _packed[j / qgemm_nr * _groups] + 4 * (j % qgemm_nr);
+                for(size_t k = 0; k < _in; ++k)
+                    dst[k / 4 * 4 * qgemm_nr + k % 4] = (int8_t)lrintf(layer.weights[k][j] / ws);
+            }
+        }
+
+        size_t outputs() const { return _out; }
+
+        // Inputs are read 4 bytes at a time; the bytes in their rows'
+        // padding beyond in.cols() meet zero weights
+        void forward(const Tensor2D<uint8_t>& in, Tensor2D<uint8_t>& out) const {
+            assert(_inv_out > 0 && _relu);
+            run(in, out);
+        }
+
+        void forward(const Tensor2D<uint8_t>& in, Tensor2D<float>& out) const {
+            run(in, out);
+        }
+
+    private:
+        size_t _in, _out, _groups, _panels;
+        Tensor2D<int8_t> _packed;       // one row per panel and group of k
+        vector<float> _scale, _bias;    // per column; scale of the int32 sums
+        bool _relu;
+        float _inv_out;
+
+        // The epilogue: scale the sums of a tile row back to float, add the
+        // bias, apply ReLU and requantize, written so that it vectorizes
+        void store(const int32_t* sums, size_t col, size_t cols, float* out) const {
+            const float* scale = &_scale[col];
+            const float* bias = &_bias[col];
+            const float floor = _relu ? 0 : -INFINITY;
+            for(size_t j = 0; j < cols; ++j)
+                out[j] = max(sums[j] * scale[j] + bias[j], floor);
+        }
+
+        void store(const int32_t* sums, size_t col, size_t cols, uint8_t* out) const {
+            const float* scale = &_scale[col];
+            const float* bias = &_bias[col];
+            int32_t q[qgemm_nr];
+            for(size_t j = 0; j < qgemm_nr; ++j)
+                q[j] = (int32_t)min(max((sums[j] * scale[j] + bias[j]) * _inv_out + 0.5f, 0.0f),
+                                    (float)quant_max);
+            for(size_t j = 0; j < cols; ++j) out[j] = q[j];
+        }
+
+        template <typename TO>
+        void run(const Tensor2D<uint8_t>& in, Tensor2D<TO>& out) const {
+            assert(in.cols() == _in && in.stride() >= 4 * _groups && msg2.c_str());
+            out.resize(in.rows(), _out);
+            const QGemmKernel& kr = *active_qgemm_kernel;
+            // Chunks of rows whose activations stay in L2 while each panel
+            // of weights is used for all of them from L1
+            const size_t chunk = kr.mr * max<size_t>(1, 64 / kr.mr);
+            parallel_range((in.rows() + chunk - 1) / chunk, 1, [&](size_t begin, size_t end) {
+                alignas(64) int32_t tile[qgemm_max_mr * qgemm_nr];
+                const uint8_t* rows[qgemm_max_mr];
+                const size_t last = min(in.rows(), end * chunk);
+                for(size_t p = 0; p < _panels; ++p) {
+                    const size_t col = p * qgemm_nr, cols = min(qgemm_nr, _out - col);
+                    for(size_t r0 = begin * chunk; r0 < last; r0 += kr.mr) {
+                        const size_t mm = min(kr.mr, last - r0);
+                        for(size_t i = 0; i < kr.mr; ++i) rows[i] = in[r0 + (i < mm ? i : 0)];
+                        kr.run(rows, _packed[p * _groups], _groups, tile);
+                        for(size_t i = 0; i < mm; ++i)
+                            store(tile + i * qgemm_nr, col, cols, out[r0 + i] + col);
+                    }
+                }
+            });
+        }
+};
+
+// An int8 copy of a trained Network. The scales of the hidden activations
+// are set so that the largest value seen on calib, a sample of inputs, is
+// the largest quantized one.
+class QuantNetwork
+{
+    public:
+        template <typename T, typename S>
+        QuantNetwork(const Network<T, S>& net, const Tensor2D<uint8_t>& calib)
+            : _in_scale(2 * net.input_scale()), _act_scale(calibrate(net, calib)),
+              layer1(net.layer(0), true, _in_scale, _act_scale[0]),
+              layer2(net.layer(1), true, _act_scale[0], _act_scale[1]),
+              layer3(net.layer(2), false, _act_scale[1], 0),
+              input(0, 0), acts1(0, 0), acts2(0, 0), scores(0, 0) {
+        }
+
+        // Scores of the last layer for a batch of raw bytes, valid until
+        // the next forward()
+        const Tensor2D<float>& forward(const Tensor2D<uint8_t>& batch) {
+            quantize_bytes(input, batch);
+            layer1.forward(input, acts1);
+            layer2.forward(acts1, acts2);
+            layer3.forward(acts2, scores);
+            return scores;
+        }
+
+        void predict(const Tensor2D<uint8_t>& batch, Tensor2D<size_t>& classes) {
+            argmax(classes, forward(batch));
+        }
+
+        // The scale of layer i's quantized output, i = 0 or 1
+        float activation_scale(size_t i) const { return _act_scale[i]; }
+
+    private:
+        float _in_scale;
+        vector<float> _act_scale;
+        QuantLinear layer1, layer2, layer3;
+        Tensor2D<uint8_t> input, acts1, acts2;
+        Tensor2D<float> scores;
+
+        template <typename T, typename S>
+        static vector<float> calibrate(const Network<T, S>& net, const Tensor2D<uint8_t>& calib) {
+            Tensor2D<float> acts1(0, 0), acts2(0, 0);
+            net.layer(0).forward(calib, acts1, nullptr, net.input_scale());
+            net.layer(1).forward(acts1, acts2);
+            vector<float> scale;
+            for(const Tensor2D<float>* a : { &acts1, &acts2 }) {
+                float amax = 0;
+                for(size_t r = 0; r < a->rows(); ++r)
+                    for(size_t c = 0; c < a->cols(); ++c) amax = max(amax, (*a)[r][c]);
+                scale.push_back(amax > 0 ? amax / quant_max : 1);
+            }
+            return scale;
+        }
+};
+
+// -----------------------------------------------------------------------------
+// Reading MNIST train/test data
+// -----------------------------------------------------------------------------
+// Combine 4 bytes to form an int, big endian assumed 
+unsigned int b2i(const char* ptr, size_t idx) {
+    unsigned int val = 0;
+    val |= (unsigned char)ptr[idx+0]; val <<= 8;
+    val |= (unsigned char)ptr[idx+1]; val <<= 8;
+    val |= (unsigned char)ptr[idx+2]; val <<= 8;
+    val |= (unsigned char)ptr[idx+3];
+    return val;
+}
+
+// A read-only, memory-mapped IDX file, the format of the MNIST files: a big
+// endian magic number whose third byte is the element type (0x08 for
+// unsigned bytes) and fourth the number of dimensions, one 32 bit size per
+// dimension, then the data. Nothing is read up front; the OS pages the data
+// in on first access and shares it with every other process mapping the
+// same file, so files larger than RAM work as well.
+class IDXFile
+{
+    public:
+        explicit IDXFile(const char* path)
+            : _map(MAP_FAILED), _size(0), _data(nullptr) {
+            int fd = open(path, O_RDONLY);
+            if(fd < 0) throw runtime_error(msg3.c_str());
+            struct stat st;
+            if(fstat(fd, &st) == 0 && st.st_size > 0) {
+                _size = st.st_size;
+                _map = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if(_map == MAP_FAILED) throw runtime_error(msg3.c_str());
+            parse();
+        }
+
+        ~IDXFile() {
+            munmap(_map, _size);
         }
 
-        const T* const operator[](size_t r) const {
-            return _data[r];
-        }
-        
-        void fill(T setval) {
-            for(size_t r = 0; r < _rows; ++r)
-                for(size_t c = 0; c < _cols; ++c)
-                    _data[r][c] = setval;
-        }
+        size_t dims() const { return _dims.size(); }
+        size_t dim(size_t i) const { return _dims[i]; }
+
+        // Bytes per item, the product of all dimensions but the first
+        size_t itemsize() const { return _itemsize; }
 
-        size_t rows() const { return _rows; }
-        size_t cols() const { return _cols; }
+        const uint8_t* data() const { return _data; }
+        const uint8_t* item(size_t i) const { return _data + i * _itemsize; }
 
     private:
-        size_t      _rows;
-        size_t      _cols;
-        T**         _data;
+        void*           _map;
+        size_t          _size;
+        const uint8_t*  _data;
+        size_t          _itemsize;
+        vector<size_t>  _dims;
 
-        void copy(const Tensor2D& rhs) {
-            _rows = rhs._rows;
-            _cols = rhs._cols;
+        IDXFile(const IDXFile&) = delete;
+        IDXFile& operator=(const IDXFile&) = delete;
 
-            alloc(_rows, _cols);
-            // TODO - Use memcpy
-            for(size_t r = 0; r < _rows; ++r)
-                for(size_t c = 0; c < _cols; ++c)
-                    _data[r][c] = rhs._data[r][c];
+        void parse() {
+            const char* p = static_cast<const char*>(_map);
+            if(_size < 4 || p[0] != 0 || p[1] != 0 || p[2] != 0x08 || p[3] == 0)
+                invalid();
+            const size_t ndims = (unsigned char)p[3];
+            const size_t header = 4 + 4 * ndims;
+            if(_size < header) invalid();
+            size_t total = 1;
+            for(size_t i = 0; i < ndims; ++i) {
+                _dims.push_back(b2i(p, 4 + 4 * i));
+                const size_t dim = _dims.back();
+                if(dim && total > SIZE_MAX / dim) invalid();    // would wrap around
+                total *= dim;
+            }
+            if(_size - header < total) invalid();
+            _itemsize = _dims[0] ? total / _dims[0] : 0;
+            _data = reinterpret_cast<const uint8_t*>(p + header);
         }
 
-        void alloc(size_t rows, size_t cols) {
-            assert((!_data) && "_data is not null");
-            _data = new T*[rows];
-            for(size_t r = 0; r < rows; ++r)
-                _data[r] = new T[cols];
+        void invalid() {
+            munmap(_map, _size);
+            throw runtime_error(msg4.c_str());
         }
+};
 
-        void dealloc() {
-            if (_data != nullptr) {
-                for(size_t r = 0; r < _rows; ++r) {
-                    if(_data[r] != nullptr) {
-                        delete[] _data[r];
-                        _data[r] = nullptr;
-                    }
-                }
-                delete[] _data;
-                _data = nullptr;
+// Hands out item indexes so that every item is visited once per epoch. The
+// order of each epoch is a permutation drawn from the seed and the epoch
+// number, so runs are reproducible. With block > 1, runs of block
+// consecutive items are shuffled instead of single items, so that batches
+// read neighbouring images. Each batch is sorted, to gather it in file order.
+class EpochSampler
+{
+    public:
+        explicit EpochSampler(size_t items, unsigned seed = shuffle_seed,
+                              size_t block = shuffle_block)
+            : _order(items), _seed(seed), _block(max<size_t>(block, 1)),
+              _epochs(0), _pos(items) {
+            _blocks.resize((items + _block - 1) / _block);
+        }
+
+        // The next count items; a batch may straddle two epochs
+        void next(Tensor2D<size_t>& items, size_t count) {
+            _batch.resize(count);
+            for(size_t i = 0; i < count; ++i) {
+                if(_pos == _order.size()) shuffle();
+                _batch[i] = _order[_pos++];
             }
-            _rows = 0;
-            _cols = 0;
+            std::sort(_batch.begin(), _batch.end());
+            items.resize(count, 1);
+            for(size_t i = 0; i < count; ++i)
+                items[i][0] = _batch[i];
         }
 
+        // Epoch of the most recently handed out item, counting from 0
+        size_t epoch() const { return _epochs ? _epochs - 1 : 0; }
+
+    private:
+        vector<size_t>  _order, _blocks, _batch;
+        unsigned        _seed;
+        size_t          _block;
+        size_t          _epochs;    // permutations drawn so far
+        size_t          _pos;       // next position in _order
+
+        void shuffle() {
+            std::seed_seq seq{ _seed, (unsigned)_epochs };
+            std::mt19937 rng(seq);
+            std::iota(_blocks.begin(), _blocks.end(), 0);
+            std::shuffle(_blocks.begin(), _blocks.end(), rng);
+            size_t k = 0;
+            for(size_t b = 0; b < _blocks.size(); ++b)
+                for(size_t i = _blocks[b] * _block; i < min(_order.size(), (_blocks[b] + 1) * _block); ++i)
+                    _order[k++] = i;
+            _pos = 0;
+            _epochs++;
+        }
 };
 
-// Dot product between Tensor2D objects
-template<typename T>
-Tensor2D<T> dot(const Tensor2D<T>& left, const Tensor2D<T>& right)
+// <data, label> pair. Pixels stay bytes; the first layer converts them.
+typedef pair<Tensor2D<uint8_t>, Tensor2D<size_t> > batchtype;
+
+class MNISTDataLoader
 {
-    assert(left.cols() == right.rows());
-    Tensor2D<T> t(left.rows(), right.cols());
+    public:
+        explicit MNISTDataLoader(const char* data_path, const char* label_path,
+                                 unsigned seed = shuffle_seed, size_t block = shuffle_block)
+            : _images(data_path), _labels(label_path),
+              _sampler(_labels.dims() == 1 ? _labels.dim(0) : 0, seed, block) {
+            if(_images.dims() != 3 || _labels.dims() != 1 ||
+               _images.dim(0) != _labels.dim(0) || _images.itemsize() != pixels)
+                throw runtime_error(msg4.c_str());
+            _num_items  = _images.dim(0);
+            _num_rows   = _images.dim(1);
+            _num_cols   = _images.dim(2);
+        }
 
-    for(size_t r = 0; r < left.rows(); ++r)
-        for(size_t i = 0; i < left.cols(); ++i)
-            for(size_t c = 0; c < right.cols(); ++c)
-                t[r][c] += left[r][i] * right[i][c];
-    return t;
-}
+        batchtype fetch(int batch_size) {
+            batchtype batch(Tensor2D<uint8_t>(batch_size, pixels),
+                            Tensor2D<size_t>(batch_size, 1));
+            fetch(batch);
+            return batch;
+        }
 
-// Add Tensor2D objects, with broadcasting
-template<typename T>
-Tensor2D<T> add(const Tensor2D<T>& left, const Tensor2D<T>& right)
-{
-    assert(left.cols() == right.cols());
-    assert((left.rows() == right.rows()) || (right.rows() == 1));
-    Tensor2D<T> t(left.rows(), left.cols());
+        // Fill a preallocated batch with the next batch.first.rows() items
+        // of the loader's own epoch order
+        void fetch(batchtype& batch) {
+            _sampler.next(batch.second, batch.first.rows());
+            gather(batch);
+        }
 
-    for(size_t r = 0; r < left.rows(); ++r)
-        for(size_t c = 0; c < left.cols(); ++c) {
-            if(right.rows() > 1) t[r][c] = left[r][c] + right[r][c];
-            else t[r][c] = left[r][c] + right[0][c];
+        // Fill a preallocated batch with the count items from first on, in
+        // file order
+        void fetch(batchtype& batch, size_t first, size_t count) const {
+            assert(first + count <= _num_items);
+            batch.second.resize(count, 1);
+            for(size_t i = 0; i < count; ++i)
+                batch.second[i][0] = first + i;
+            gather(batch);
         }
-    return t;
-}
 
-// Subtract Tensor2D objects, with broadcasting
-template<typename T>
-Tensor2D<T> sub(const Tensor2D<T>& left, const Tensor2D<T>& right)
-{
-    assert(left.cols() == right.cols());
-    assert((left.rows() == right.rows()) || (right.rows() == 1));
-    Tensor2D<T> t(left.rows(), left.cols());
+        // Replace the item indexes in batch.second by their labels and copy
+        // their pixels into batch.first, split across threads. sparse, if
+        // given, receives the nonzero pixels as well.
+        void gather(batchtype& batch, SparseBytes* sparse = nullptr) const {
+            Tensor2D<uint8_t>&     data = batch.first;
+            Tensor2D<size_t>&      label = batch.second;
+            data.resize(label.rows(), pixels);
+            PROFILE_SCOPE(phase_fetch, 0, 2.0 * label.rows() * pixels, label.rows());
 
-    for(size_t r = 0; r < left.rows(); ++r)
-        for(size_t c = 0; c < left.cols(); ++c) {
-            if(right.rows() > 1) t[r][c] = left[r][c] - right[r][c];
-            else t[r][c] = left[r][c] - right[0][c];
+            parallel_range(label.rows(), row_grain(pixels), [&](size_t begin, size_t end) {
+                for(size_t i = begin; i < end; ++i) {
+                    const size_t item = label[i][0];
+                    assert((item < _num_items) && "index failure");
+                    label[i][0] = *_labels.item(item);
+                    memcpy(data[i], _images.item(item), pixels);
+                }
+            });
+            if(sparse) to_sparse(*sparse, data);
         }
-    return t;
-}
 
-// Multiply a Tensor2D object with a scalar float
-template<typename T>
-Tensor2D<T> mul(const Tensor2D<T>& left, float x)
-{
-    Tensor2D<T> t(left.rows(), left.cols());
-    for(size_t r = 0; r < left.rows(); ++r)
-        for(size_t c = 0; c < left.cols(); ++c)
-            t[r][c] = left[r][c] * x;
-    return t;
-}
+        size_t numitems() const {
+            return _num_items;
+        }
 
-// Transpose a Tensor2D object
-template<typename T>
-Tensor2D<T> transpose(const Tensor2D<T>& input)
-{
-    Tensor2D<T> t(input.cols(), input.rows());
-    for(size_t r = 0; r < input.rows(); ++r)
-        for(size_t c = 0; c < input.cols(); ++c)
-            t[c][r] = input[r][c];
-    return t;
-}
+        // The raw pixels (numitems() x pixels) and labels, without copies
+        const uint8_t* images() const { return _images.data(); }
+        const uint8_t* labels() const { return _labels.data(); }
 
-// -----------------------------------------------------------------------------
-// Loss function
-// -----------------------------------------------------------------------------
+    private:
+        IDXFile _images, _labels;
+        EpochSampler _sampler;
+        size_t _num_items, _num_rows, _num_cols;
+};
 
-template <typename T>
-T maxval(const T* const data, size_t count) {
-    T m = 0;
-    for(size_t i = 0; i < count; ++i)
-        if (data[i] > m) m = data[i];
-    return m;
-}
 
-template <typename T>
-size_t maxidx(const T* const data, size_t count) {
-    T m = 0;
-    size_t idx = -1;
-    for(size_t i = 0; i < count; ++i)
-        if (data[i] > m) { m = data[i]; idx = i; } 
-    return idx;
-}
+// Assembles batches ahead of the training loop on background threads, into a
+// ring of depth preallocated batches, in epoch order. next() hands out the oldest finished
+// batch by reference, without copying; it stays valid until the following
+// call to next(), and its slot is refilled after that. With depth 2 one
+// batch is being trained on while the next one is prepared.
+class BatchPrefetcher
+{
+    public:
+        explicit BatchPrefetcher(const MNISTDataLoader& loader, size_t batch_size,
+                                 size_t depth = 2, size_t threads = 1,
+                                 unsigned seed = shuffle_seed, size_t block = shuffle_block)
+            : _loader(loader), _sampler(loader.numitems(), seed, block),
+              _sparse(max<size_t>(depth, 2)), _ready(max<size_t>(depth, 2), 0),
+              _claimed(0), _released(0), _holding(false), _stop(false),
+              _stalls(0), _stall_time(0) {
+            for(size_t i = 0; i < _ready.size(); ++i)
+                _ring.push_back(batchtype(Tensor2D<uint8_t>(batch_size, pixels),
+                                          Tensor2D<size_t>(batch_size, 1)));
+            for(size_t i = 0; i < max<size_t>(threads, 1); ++i)
+                _threads.push_back(thread(&BatchPrefetcher::produce, this));
+        }
 
-// Numerically stable softmax
-template <typename T>
-Tensor2D<T> softmax(Tensor2D<T> scores) {
+        ~BatchPrefetcher() {
+            {
+                lock_guard<mutex> lk(_mutex);
+                _stop = true;
+            }
+            _cond.notify_all();
+            for(size_t i = 0; i < _threads.size(); ++i)
+                _threads[i].join();
+        }
 
-    Tensor2D<T> max(scores.rows(), 1);
-    Tensor2D<T> expsum(scores.rows(), 1);
+        const batchtype& next() {
+            PROFILE_SCOPE(phase_wait);
+            unique_lock<mutex> lk(_mutex);
+            if(_holding) {
+                _released++;
+                _cond.notify_all();
+            }
+            const size_t slot = _released % _ring.size();
+            if(!_ready[slot]) {
+                const auto t0 = std::chrono::steady_clock::now();
+                _cond.wait(lk, [&] { return _ready[slot] != 0; });
+                _stalls++;
+                _stall_time += std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - t0).count();
+            }
+            _ready[slot] = 0;
+            _holding = true;
+            return _ring[slot];
+        }
 
-    for(size_t r = 0; r < scores.rows(); ++r)
-        max[r][0] = maxval(scores[r], scores.cols());
+        // Batches ready and waiting for next(), out of depth()
+        size_t queued() const {
+            lock_guard<mutex> lk(_mutex);
+            size_t n = 0;
+            for(size_t i = 0; i < _ready.size(); ++i) n += _ready[i];
+            return n;
+        }
 
-    for(size_t r = 0; r < scores.rows(); ++r)
-        for(size_t c = 0; c < scores.cols(); ++c)
-            scores[r][c] = scores[r][c] - max[r][0];
+        size_t depth() const { return _ring.size(); }
 
-    for(size_t r = 0; r < scores.rows(); ++r)
-        for(size_t c = 0; c < scores.cols(); ++c)
-            expsum[r][0] += exp(scores[r][c]); 
+        // The nonzeros of the batch last returned by next()
+        const SparseBytes& sparse() const { return _sparse[_released % _ring.size()]; }
 
-    for(size_t r = 0; r < scores.rows(); ++r)
-        for(size_t c = 0; c < scores.cols(); ++c)
-            scores[r][c] = exp(scores[r][c]) / expsum[r][0];
+        // Calls to next() that had to wait, and the total seconds waited.
+        // A growing stall time means the loader is the bottleneck.
+        size_t stalls() const { lock_guard<mutex> lk(_mutex); return _stalls; }
+        double stall_time() const { lock_guard<mutex> lk(_mutex); return _stall_time; }
 
-    return scores;
-}
+    private:
+        const MNISTDataLoader&  _loader;
+        EpochSampler            _sampler;   // separate from the loader's fetch()
+        vector<batchtype>       _ring;
+        vector<SparseBytes>     _sparse;    // CSR form of each batch
+        vector<char>            _ready;     // slot holds a finished batch
+        vector<thread>          _threads;
+        mutable mutex           _mutex;
+        condition_variable      _cond;
+        size_t                  _claimed;   // batches started by producers
+        size_t                  _released;  // batches handed out and given back
+        bool                    _holding;   // the consumer holds slot _released
+        bool                    _stop;
+        size_t                  _stalls;
+        double                  _stall_time;
 
-// Log loss cross entropy
-template<typename T>
-float logloss(const Tensor2D<size_t>& actual, const Tensor2D<T>& prediction) {
-    float loss = 0.0;
-    assert(actual.rows() == prediction.rows());
-    for(size_t r = 0; r < actual.rows(); ++r) {
-        size_t idx = actual[r][0];
-        loss += -1.0 * log(prediction[r][idx]);
-    }
-    return loss / actual.rows();
-}
+        BatchPrefetcher(const BatchPrefetcher&) = delete;
+        BatchPrefetcher& operator=(const BatchPrefetcher&) = delete;
 
-// -----------------------------------------------------------------------------
-// Neural Network
-// -----------------------------------------------------------------------------
+        void produce() {
+            serial_thread() = true;
+            unique_lock<mutex> lk(_mutex);
+            for(;;) {
+                // The slot of batch n is free once batch n - depth was released
+                _cond.wait(lk, [&] { return _stop || _claimed < _released + _ring.size(); });
+                if(_stop) return;
+                const size_t slot = _claimed++ % _ring.size();
+                batchtype& batch = _ring[slot];
+                _sampler.next(batch.second, batch.first.rows());
+                lk.unlock();
+                _loader.gather(batch, &_sparse[slot]);
+                lk.lock();
+                _ready[slot] = 1;
+                _cond.notify_all();
+            }
+        }
+};
 
-// ReLU activation function (modified the input, taken as reference)
-template <typename T>
-void relu(Tensor2D<T>& input) {
-    for(size_t r = 0; r < input.rows(); r++)
-        for(size_t c = 0; c < input.cols(); c++)
-            if(input[r][c] <= 0.0) input[r][c] = 0.0;
+// Fraction of the first count items of loader that nt classifies correctly,
+// streamed through chunk, whose rows set how many are evaluated at a time
+template <typename Model>
+float accuracy(Model& nt, const MNISTDataLoader& loader, size_t count,
+               batchtype& chunk, Tensor2D<size_t>& predicted)
+{
+    PROFILE_SCOPE(phase_eval, 0, 0, count);
+    const size_t rows = chunk.first.rows();
+    size_t totcorrect = 0;
+    for(size_t first = 0; first < count; first += rows) {
+        loader.fetch(chunk, first, min(rows, count - first));
+        argmax(predicted, nt.forward(chunk.first));
+        for(size_t r = 0; r < predicted.rows(); ++r)
+            if(chunk.second[r][0] == predicted[r][0])
+                totcorrect++;
+    }
+    return count ? (float)totcorrect / count : 0;
 }
 
-// Linear layer
-template <typename T>
-class Linear 
+// Accuracy of a snapshot of the network after some batch
+struct EvalResult
+{
+    size_t epoch, batch;
+    float  train_acc, test_acc;
+};
+
+// Evaluates snapshots of a network on a background thread, so that training
+// never waits for it. The whole test set and the first train_items of the
+// training set are streamed in chunks of chunk rows. submit() copies the
+// parameters and returns at once; while an evaluation is running it
+// declines, and that snapshot is skipped.
+template <typename T, typename S = T>
+class Evaluator
 {
     public:
-        explicit Linear(size_t in, size_t out, bool add_relu = true)
-            : weights(in, out), biases(1, out), weights_grad(in, out),
-              biases_grad(1, out), activations(1, 1), add_relu(add_relu) {
-                init();
+        explicit Evaluator(const Network<T, S>& like, const MNISTDataLoader& train,
+                           const MNISTDataLoader& test, size_t chunk = eval_chunk,
+                           size_t train_items = eval_train_items)
+            : _train(train), _test(test), _net(like, chunk),
+              _chunk(Tensor2D<uint8_t>(chunk, pixels), Tensor2D<size_t>(chunk, 1)),
+              _predicted(chunk, 1), _train_items(min(train_items, train.numitems())),
+              _busy(false), _fresh(false), _stop(false) {
+            _thread = thread(&Evaluator::run, this);
         }
 
-        void forward(const Tensor2D<T>& input) {
-            activations = add(dot(input, weights), biases);
-            if(add_relu) relu(activations);
+        ~Evaluator() {
+            {
+                lock_guard<mutex> lk(_mutex);
+                _stop = true;
+            }
+            _cond.notify_all();
+            _thread.join();
         }
 
-        Tensor2D<T> eval(const Tensor2D<T>& input) const {
-            auto scores = add(dot(input, weights), biases);
-            if(add_relu) relu(scores);
-            return scores;
+        // Start evaluating the current parameters of nt, unless busy
+        bool submit(const Network<T, S>& nt, size_t epoch, size_t batch) {
+            lock_guard<mutex> lk(_mutex);
+            if(_busy) return false;
+            _net.copy_params(nt);
+            _pending.epoch = epoch;
+            _pending.batch = batch;
+            _busy = true;
+            _cond.notify_all();
+            return true;
         }
 
-        void clear() {
-            weights_grad.fill(0.0);
-            biases_grad.fill(0.0);
-            activations.fill(0.0);
+        // The result finished since the last call, if any
+        bool poll(EvalResult& result) {
+            lock_guard<mutex> lk(_mutex);
+            if(!_fresh) return false;
+            result = _result;
+            _fresh = false;
+            return true;
         }
 
-        const Tensor2D<T>& getacts() const {
-            return activations;
+        // Block until the running evaluation, if any, is done
+        void wait() {
+            unique_lock<mutex> lk(_mutex);
+            _cond.wait(lk, [&] { return !_busy; });
         }
 
-        Tensor2D<T> weights;
-        Tensor2D<T> biases;
-        Tensor2D<T> weights_grad;
-        Tensor2D<T> biases_grad;
-        Tensor2D<T> activations;
-
     private:
-        bool add_relu;
+        const MNISTDataLoader&  _train;
+        const MNISTDataLoader&  _test;
+        Network<T, S>           _net;       // the snapshot
+        batchtype               _chunk;
+        Tensor2D<size_t>        _predicted;
+        size_t                  _train_items;
+        EvalResult              _pending, _result;
+        thread                  _thread;
+        mutex                   _mutex;
+        condition_variable      _cond;
+        bool                    _busy;      // _net holds a snapshot to evaluate
+        bool                    _fresh;     // _result has not been polled
+        bool                    _stop;
 
-        void init() {
-            for(size_t i = 0; i < weights.rows(); ++i)
-                for(size_t j = 0; j < weights.cols(); ++j)
-                    weights[i][j] = genrand();
-            for(size_t i = 0; i < biases.rows(); ++i)
-                for(size_t j = 0; j < biases.cols(); ++j)
-                    biases[i][j] = 0.001;
+        Evaluator(const Evaluator&) = delete;
+        Evaluator& operator=(const Evaluator&) = delete;
+
+        void run() {
+            serial_thread() = true;
+            unique_lock<mutex> lk(_mutex);
+            for(;;) {
+                _cond.wait(lk, [&] { return _stop || _busy; });
+                if(_stop) return;
+                EvalResult r = _pending;
+                lk.unlock();
+                r.train_acc = accuracy(_net, _train, _train_items, _chunk, _predicted);
+                r.test_acc = accuracy(_net, _test, _test.numitems(), _chunk, _predicted);
+                lk.lock();
+                _result = r;
+                _fresh = true;
+                _busy = false;
+                _cond.notify_all();
+            }
         }
 };
 
-// The Network
-template <typename T>
-class Network
+// Writes checkpoints of a network on a background thread. submit() only
+// copies the parameters, which are then written while training goes on.
+template <typename T, typename S = T>
+class Checkpointer
 {
     public:
-        explicit Network(size_t in, size_t out, size_t h1, size_t h2) 
-            : layer1(in, h1), layer2(h1, h2), layer3(h2, out, false) {
+        explicit Checkpointer(const Network<T, S>& like, const string& path = checkpoint_path)
+            : _path(path), _net(like, 1), _step(0), _written(0), _failed(0),
+              _busy(false), _stop(false) {
+            _thread = thread(&Checkpointer::run, this);
         }
 
-        Tensor2D<T> forward(const Tensor2D<T>& input) {
-            layer1.forward(input);
-            layer2.forward(layer1.getacts());
-            layer3.forward(layer2.getacts());
-            return softmax(layer3.getacts());
+        ~Checkpointer() {
+            {
+                lock_guard<mutex> lk(_mutex);
+                _stop = true;
+            }
+            _cond.notify_all();
+            _thread.join();
         }
 
-        Tensor2D<T> eval(const Tensor2D<T>& input) const {
-            return softmax(layer3.eval(layer2.eval(layer1.eval(input))));
+        // Start writing the current parameters of nt, unless busy
+        bool submit(const Network<T, S>& nt, uint64_t step) {
+            lock_guard<mutex> lk(_mutex);
+            if(_busy) return false;
+            _net.copy_params(nt);
+            _step = step;
+            _busy = true;
+            _cond.notify_all();
+            return true;
         }
 
-        void backward(Tensor2D<T> sm, const Tensor2D<size_t>& actual, 
-                const Tensor2D<T>& input) {
-            
-            // Backprop through softmax
-            for(size_t r = 0; r < sm.rows(); ++r)
-                sm[r][actual[r][0]] -= 1;
-
-            for(size_t r = 0; r < sm.rows(); ++r)
-                for(size_t c = 0; c < sm.cols(); ++c)
-                    sm[r][c] /= sm.rows();
+        // Block until the running write, if any, is done
+        void wait() {
+            unique_lock<mutex> lk(_mutex);
+            _cond.wait(lk, [&] { return !_busy; });
+        }
 
-            // Backprop through layer3 
-            layer3.weights_grad = dot(transpose(layer2.getacts()), sm);
-            layer3.weights_grad = add(layer3.weights_grad, mul(layer3.weights, wt_reg));
-            for(size_t r = 0; r < sm.rows(); ++r)
-                for(size_t c = 0; c < sm.cols(); ++c)
-                    layer3.biases_grad[0][c] += sm[r][c];
+        // Checkpoints written, and those that could not be
+        size_t written() const { lock_guard<mutex> lk(_mutex); return _written; }
+        size_t failed()  const { lock_guard<mutex> lk(_mutex); return _failed; }
 
-            // Backprop through layer2 
-            auto hidden2 = dot(sm, transpose(layer3.weights));
-            for(size_t r = 0; r < hidden2.rows(); ++r)
-                for(size_t c = 0; c < hidden2.cols(); ++c)
-                    if (layer2.getacts()[r][c] == 0)
-                        hidden2[r][c] = 0.0;
+    private:
+        string                  _path;
+        Network<T, S>           _net;       // the snapshot
+        uint64_t                _step;
+        size_t                  _written, _failed;
+        thread                  _thread;
+        mutable mutex           _mutex;
+        condition_variable      _cond;
+        bool                    _busy;      // _net holds a snapshot to write
+        bool                    _stop;
 
-            layer2.weights_grad = dot(transpose(layer1.getacts()), hidden2);
-            layer2.weights_grad = add(layer2.weights_grad, mul(layer2.weights, wt_reg));
-            for(size_t r = 0; r < hidden2.rows(); ++r)
-                for(size_t c = 0; c < hidden2.cols(); ++c)
-                    layer2.biases_grad[0][c] += hidden2[r][c];
+        Checkpointer(const Checkpointer&) = delete;
+        Checkpointer& operator=(const Checkpointer&) = delete;
 
-            // Backprop through layer1 
-            auto hidden1 = dot(hidden2, transpose(layer2.weights));
-            for(size_t r = 0; r < hidden1.rows(); ++r)
-                for(size_t c = 0; c < hidden1.cols(); ++c) {
-                    if (layer1.getacts()[r][c] == 0)
-                        hidden1[r][c] = 0.0;
+        void run() {
+            unique_lock<mutex> lk(_mutex);
+            for(;;) {
+                _cond.wait(lk, [&] { return _stop || _busy; });
+                if(_stop) return;
+                lk.unlock();
+                bool ok = true;
+                try {
+                    _net.save(_path, _step);
+                } catch(const runtime_error&) {
+                    ok = false;
                 }
-
-            layer1.weights_grad = dot(transpose(input), hidden1);
-            layer1.weights_grad = add(layer1.weights_grad, mul(layer1.weights, wt_reg));
-            for(size_t r = 0; r < hidden1.rows(); ++r)
-                for(size_t c = 0; c < hidden1.cols(); ++c)
-                    layer1.biases_grad[0][c] += hidden1[r][c];
+                lk.lock();
+                (ok ? _written : _failed)++;
+                _busy = false;
+                _cond.notify_all();
+            }
         }
+};
 
-        void opt(float lr=learn_rate) {
-            layer1.weights = sub(layer1.weights, mul(layer1.weights_grad, lr));
-            layer2.weights = sub(layer2.weights, mul(layer2.weights_grad, lr));
-            layer3.weights = sub(layer3.weights, mul(layer3.weights_grad, lr));
+// Peak resident memory of the process so far, in MB
+double peak_memory() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
 
-            layer1.biases = sub(layer1.biases, mul(layer1.biases_grad, lr));
-            layer2.biases = sub(layer2.biases, mul(layer2.biases_grad, lr));
-            layer3.biases = sub(layer3.biases, mul(layer3.biases_grad, lr));
+void print_eval(const EvalResult& r, size_t epochs, size_t batches)
+{
+    cout << "Ep:" << r.epoch << "/" << epochs << ", Batch:";
+    cout << r.batch << "/" << batches << ") ";
+    cout << setprecision(3) << fixed;
+    cout << "Train Acc: " << r.train_acc << ", Test Acc: " << r.test_acc << endl;
+}
 
-            clear();
-        }
+// Quantize net, calibrated on the first quant_calib_items of train, and
+// compare the accuracy and inference rate of both versions on test
+template <typename T, typename S>
+void print_quant(Network<T, S>& net, const MNISTDataLoader& train, const MNISTDataLoader& test)
+{
+    batchtype chunk(Tensor2D<uint8_t>(0, 0), Tensor2D<size_t>(0, 1));
+    train.fetch(chunk, 0, min(quant_calib_items, train.numitems()));
+    QuantNetwork qnet(net, chunk.first);
 
-    private:
-        Linear<T> layer1;
-        Linear<T> layer2;
-        Linear<T> layer3;
+    chunk.first.resize(eval_chunk, pixels);
+    chunk.second.resize(eval_chunk, 1);
+    Tensor2D<size_t> predicted(eval_chunk, 1);
+    double seconds[2];
+    float acc[2];
+    for(size_t k = 0; k < 2; ++k) {
+        const auto t0 = std::chrono::steady_clock::now();
+        acc[k] = k ? accuracy(qnet, test, test.numitems(), chunk, predicted)
+                   : accuracy(net, test, test.numitems(), chunk, predicted);
+        seconds[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+    const double rate = test.numitems() / seconds[1] / num_threads();
+    cout << setprecision(3) << fixed;
+    cout << "Int8 Test Acc: " << acc[1] << " (float " << acc[0] << ", delta ";
+    cout << acc[1] - acc[0] << "), " << setprecision(0) << rate << " inferences/s per thread, ";
+    cout << setprecision(2) << seconds[0] / seconds[1] << "x float" << endl;
+}
 
-        void clear() {
-            layer1.clear();
-            layer2.clear();
-            layer3.clear();
-        }
+// -----------------------------------------------------------------------------
+// Serving
+// -----------------------------------------------------------------------------
+// The inference server reads requests of one image, pixels raw bytes, from
+// each connection and answers every one, in order, with an InferenceReply.
+// Requests from all connections are queued and evaluated in batches: a
+// batch is run as soon as it is full, or when its oldest request has waited
+// the deadline, whichever comes first.
+const size_t num_classes = 10;
 
+struct InferenceReply
+{
+    uint32_t label;                 // the most probable class
+    float    probs[num_classes];
 };
 
-// -----------------------------------------------------------------------------
-// Reading MNIST train/test data
-// -----------------------------------------------------------------------------
-// Combine 4 bytes to form an int, big endian assumed 
-unsigned int b2i(const char* ptr, size_t idx) {
-    unsigned int val = 0;
-    val |= (unsigned char)ptr[idx+0]; val <<= 8;
-    val |= (unsigned char)ptr[idx+1]; val <<= 8;
-    val |= (unsigned char)ptr[idx+2]; val <<= 8;
-    val |= (unsigned char)ptr[idx+3];
-    return val;
+// Read or write exactly n bytes; false on end of file or error. Writes to
+// a socket whose peer has gone fail with EPIPE rather than raise SIGPIPE.
+inline bool read_full(int fd, void* buf, size_t n) {
+    char* p = static_cast<char*>(buf);
+    while(n) {
+        const ssize_t got = read(fd, p, n);
+        if(got <= 0) return false;
+        p += got;
+        n -= got;
+    }
+    return true;
 }
 
-// <data, label> pair
-typedef pair<Tensor2D<precision>, Tensor2D<size_t> > batchtype;
+inline bool write_full(int fd, const void* buf, size_t n) {
+    const char* p = static_cast<const char*>(buf);
+    while(n) {
+        ssize_t put = send(fd, p, n, MSG_NOSIGNAL);
+        if(put < 0 && errno == ENOTSOCK) put = write(fd, p, n);
+        if(put <= 0) return false;
+        p += put;
+        n -= put;
+    }
+    return true;
+}
 
-class MNISTDataLoader
+// Request latencies, and how fast they came, since the last summary
+class LatencyStats
 {
     public:
-        explicit MNISTDataLoader(const char* data_path, const char* label_path)
-            : _data(NULL), _label(NULL) {
-            
-            _data_size  = fill(_data, data_path);
-            _label_size = fill(_label, label_path);
-            _num_items  = b2i(_data, 4);
-            _num_rows   = b2i(_data, 8);
-            _num_cols   = b2i(_data, 12);
-            assert(_num_items == b2i(_label, 4));
+        struct Summary
+        {
+            size_t count, batches;
+            double p50, p99;            // seconds
+            double rate;                // requests per second
+            double mean_batch;
+        };
+
+        LatencyStats() : _batches(0), _start(std::chrono::steady_clock::now()) {}
+
+        void record(const double* seconds, size_t n) {
+            lock_guard<mutex> lk(_mutex);
+            _latency.insert(_latency.end(), seconds, seconds + n);
+            _batches++;
         }
 
-        ~MNISTDataLoader() {
-            delete[] _data;
-            delete[] _label;
+        // Summarise and start over
+        Summary take() {
+            lock_guard<mutex> lk(_mutex);
+            const auto now = std::chrono::steady_clock::now();
+            Summary s;
+            s.count = _latency.size();
+            s.batches = _batches;
+            s.p50 = percentile(0.50);
+            s.p99 = percentile(0.99);
+            s.rate = s.count / std::chrono::duration<double>(now - _start).count();
+            s.mean_batch = _batches ? (double)s.count / _batches : 0;
+            _latency.clear();
+            _batches = 0;
+            _start = now;
+            return s;
         }
 
-        batchtype fetch(int batch_size) {
+    private:
+        mutex                                   _mutex;
+        vector<double>                          _latency;
+        size_t                                  _batches;
+        std::chrono::steady_clock::time_point   _start;
 
-            Tensor2D<precision>    data(batch_size, pixels);
-            Tensor2D<size_t>       label(batch_size, 1);
-            std::uniform_int_distribution<> dis(0, _num_items-1);
-
-            for(int i = 0; i < batch_size; ++i) {
-                size_t offset = dis(gen);
-                assert((_label_size > (8 + offset)) && "_label index failure");
-                label[i][0] = static_cast<size_t>((unsigned char)_label[8 + offset]);
-                int off = 16 + (offset * pixels);
-                for(size_t p = 0; p < pixels; p++) {
-                    assert((_data_size > (off + p)) && "_data index failure");
-                    data[i][p] = static_cast<precision>((unsigned char)_data[off + p]);
-                }
+        double percentile(double p) {
+            if(_latency.empty()) return 0;
+            const size_t k = min(_latency.size() - 1, (size_t)(p * _latency.size()));
+            std::nth_element(_latency.begin(), _latency.begin() + k, _latency.end());
+            return _latency[k];
+        }
+};
+
+void print_latency(ostream& out, const LatencyStats::Summary& s, bool batches = true)
+{
+    out << setprecision(3) << fixed;
+    out << s.count << " requests, " << setprecision(0) << s.rate << "/s, ";
+    out << setprecision(3) << "p50 " << s.p50 * 1e3 << " ms, p99 " << s.p99 * 1e3 << " ms";
+    if(batches) out << ", mean batch " << setprecision(1) << s.mean_batch;
+    out << endl;
+}
+
+// Batches requests for a Model, anything with a forward() taking a batch
+// of raw bytes and returning its scores, which is only used from the
+// server's own thread.
+template <typename Model>
+class BatchServer
+{
+    public:
+        explicit BatchServer(Model& model, size_t max_batch = serve_max_batch,
+                             double deadline = serve_deadline)
+            : _model(model), _max_batch(max_batch),
+              _deadline(std::chrono::duration_cast<clock::duration>(
+                        std::chrono::duration<double>(deadline))),
+              _batch(max_batch, pixels), _probs(max_batch, num_classes),
+              _classes(max_batch, 1), _listen(-1), _stop(false) {
+            _thread = thread(&BatchServer::run, this);
+        }
+
+        ~BatchServer() {
+            close_connections();
+            {
+                lock_guard<mutex> lk(_mutex);
+                _stop = true;
             }
+            _cond.notify_all();
+            _thread.join();
+        }
 
-            return batchtype(data, label);
+        // Serve the requests read from in, replying on out, until in ends.
+        // Returns once every reply is written. Each connection is served
+        // by its own thread.
+        void serve(int in, int out) {
+            Connection conn = { out, 0 };
+            Request req;
+            req.conn = &conn;
+            while(read_full(in, req.image, pixels)) {
+                req.arrival = clock::now();
+                lock_guard<mutex> lk(_mutex);
+                _queue.push_back(req);
+                conn.pending++;
+                _cond.notify_all();
+            }
+            unique_lock<mutex> lk(_mutex);
+            _cond.wait(lk, [&] { return conn.pending == 0; });
         }
 
-        size_t numitems() const {
-            return _num_items;
+        // Accept connections on a Unix domain socket at path, serving each
+        // on a thread of its own, until the listening socket fails. A stale
+        // socket at path is replaced; anything else there is left alone and
+        // fails the call. The connections are closed before returning.
+        void listen(const string& path) {
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            if(path.size() >= sizeof(addr.sun_path)) throw runtime_error(msg7.c_str());
+            strcpy(addr.sun_path, path.c_str());
+            struct stat st;
+            if(lstat(path.c_str(), &st) == 0) {
+                if(!S_ISSOCK(st.st_mode)) throw runtime_error(msg7.c_str());
+                unlink(path.c_str());
+            }
+            _listen = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(_listen < 0 || bind(_listen, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+               ::listen(_listen, 64) != 0) {
+                if(_listen >= 0) close(_listen);
+                throw runtime_error(msg7.c_str());
+            }
+            for(;;) {
+                const int fd = accept(_listen, nullptr, nullptr);
+                if(fd < 0) {
+                    if(errno == EINTR || errno == ECONNABORTED) continue;
+                    if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                        // Out of descriptors or memory: wait for connections to end
+                        this_thread::sleep_for(std::chrono::milliseconds(100));
+                        continue;
+                    }
+                    break;
+                }
+                reap_connections();
+                lock_guard<mutex> lk(_mutex);
+                _workers.push_back(Worker());
+                Worker& w = _workers.back();
+                w.fd = fd;
+                w.done = false;
+                w.thread = thread([this, &w] {
+                    serve(w.fd, w.fd);
+                    lock_guard<mutex> lk(_mutex);
+                    w.done = true;
+                });
+            }
+            close(_listen);
+            close_connections();
         }
 
+        LatencyStats& stats() { return _stats; }
+
     private:
-        char* _data, * _label;
-        size_t _data_size, _label_size, _num_items, _num_rows, _num_cols;
-
-        /*
-        I am assuming that we have enough RAM to load the entire 
-        dataset into memory at once (~54 MB for MNIST). If not, I 
-        would have loaded it part by part on the fly.
-        */
-        size_t fill(char*& target, const char* file_path) {
-            ifstream fd(file_path, ios::in|ios::binary);
-            if(fd) {
-                fd.seekg(0, ios::end);
-                std::fstream::pos_type size = fd.tellg();
-                fd.seekg(0, ios::beg);
-                target = new char[size];
-                fd.read(&target[0], size);
-                fd.close();
-                return size;
-            } else {
-                throw runtime_error(msg3.c_str());
+        typedef std::chrono::steady_clock clock;
+
+        struct Connection
+        {
+            int     out;
+            size_t  pending;        // requests queued or being evaluated
+        };
+
+        struct Request
+        {
+            Connection*         conn;
+            clock::time_point   arrival;
+            uint8_t             image[pixels];
+        };
+
+        // The thread serving a connection accepted by listen()
+        struct Worker
+        {
+            std::thread thread;
+            int         fd;
+            bool        done;       // serve() has returned
+        };
+
+        Model&                  _model;
+        size_t                  _max_batch;
+        clock::duration         _deadline;
+        deque<Request>          _queue;
+        Tensor2D<uint8_t>       _batch;
+        Tensor2D<float>         _probs;
+        Tensor2D<size_t>        _classes;
+        LatencyStats            _stats;
+        int                     _listen;
+        list<Worker>            _workers;   // guarded by _mutex
+        thread                  _thread;
+        mutex                   _mutex;
+        condition_variable      _cond;
+        bool                    _stop;
+
+        BatchServer(const BatchServer&) = delete;
+        BatchServer& operator=(const BatchServer&) = delete;
+
+        // Join and close the connections that have ended
+        void reap_connections() {
+            list<Worker> done;
+            {
+                lock_guard<mutex> lk(_mutex);
+                for(auto it = _workers.begin(); it != _workers.end(); )
+                    if(it->done) done.splice(done.end(), _workers, it++);
+                    else ++it;
+            }
+            for(Worker& w : done) {
+                w.thread.join();
+                close(w.fd);
             }
         }
-};
 
+        // End every connection: their reads fail, their pending replies
+        // are written (or fail) and their threads return
+        void close_connections() {
+            {
+                lock_guard<mutex> lk(_mutex);
+                for(Worker& w : _workers) shutdown(w.fd, SHUT_RDWR);
+            }
+            for(;;) {
+                Worker* w;
+                {
+                    lock_guard<mutex> lk(_mutex);
+                    if(_workers.empty()) return;
+                    w = &_workers.front();      // its thread still refers to it
+                }
+                w->thread.join();
+                close(w->fd);
+                lock_guard<mutex> lk(_mutex);
+                _workers.pop_front();
+            }
+        }
 
-float get_accuracy(const Network<precision>& nt, MNISTDataLoader& loader)
-{
-    // We will randomly select items from the set and calculate the accuracy
-    batchtype data = loader.fetch(10000);
-    auto sm = nt.eval(data.first);
-    size_t totcorrect = 0;
-    for(size_t r = 0; r < sm.rows(); ++r) {
-        if(data.second[r][0] == maxidx(sm[r], sm.cols()))
-            totcorrect++;
-    }
+        void run() {
+            vector<Connection*> conns(_max_batch);
+            vector<clock::time_point> arrival(_max_batch);
+            vector<double> latency(_max_batch);
+            unique_lock<mutex> lk(_mutex);
+            for(;;) {
+                _cond.wait(lk, [&] { return _stop || !_queue.empty(); });
+                if(_queue.empty()) return;
+                _cond.wait_until(lk, _queue.front().arrival + _deadline,
+                                 [&] { return _stop || _queue.size() >= _max_batch; });
 
-    return (float)totcorrect/sm.rows();
-}
+                // Take the oldest requests, evaluate them unlocked
+                const size_t n = min(_max_batch, _queue.size());
+                _batch.resize(n, pixels);
+                for(size_t r = 0; r < n; ++r) {
+                    const Request& req = _queue.front();
+                    memcpy(_batch[r], req.image, pixels);
+                    conns[r] = req.conn;
+                    arrival[r] = req.arrival;
+                    _queue.pop_front();
+                }
+                lk.unlock();
+                softmax(_probs, _model.forward(_batch));
+                argmax(_classes, _probs);
+                InferenceReply reply;
+                for(size_t r = 0; r < n; ++r) {
+                    reply.label = _classes[r][0];
+                    memcpy(reply.probs, _probs[r], sizeof(reply.probs));
+                    write_full(conns[r]->out, &reply, sizeof(reply));
+                    latency[r] = std::chrono::duration<double>(clock::now() - arrival[r]).count();
+                }
+                _stats.record(latency.data(), n);
+                lk.lock();
+                for(size_t r = 0; r < n; ++r) conns[r]->pending--;
+                _cond.notify_all();
+            }
+        }
+};
 
-void mnist()
+// Train, with the gradients of each batch computed micro rows at a time
+// (all at once if 0), which caps the memory held by activations
+void mnist(size_t micro = micro_batch)
 {
     cout << "Starting MNIST training ..." << endl;
     MNISTDataLoader train(train_data, train_label);
     MNISTDataLoader test(test_data, test_label);
-    Network<precision> nt(784, 10, 512, 1024);
+    micro = micro ? min(micro, batch_size) : batch_size;
+    Network<precision, storage> nt(784, 10, 512, 1024, micro);
+    cout << "Batches of " << batch_size << " rows, in micro-batches of " << micro << endl;
+    if(*gemm_tuning_path) {
+        const size_t tuned = gemm_autotune(nt.gemm_shapes(replicas > 1 ? batch_size / replicas : micro),
+                                           gemm_tuning_path);
+        cout << "GEMM configurations tuned: " << tuned << ", loaded: ";
+        cout << gemm_tuned().size() - tuned << " (" << gemm_tuning_path << ")" << endl;
+    }
 
     size_t epochs = num_epochs;
     size_t batches = train.numitems() / batch_size;
     size_t i = 1;
+    BatchPrefetcher prefetch(train, batch_size, 3);
+    DataParallel<precision, storage> parallel(nt, replicas);
+    Evaluator<precision, storage> evaluator(nt, train, test);
+    Checkpointer<precision, storage> checkpointer(nt);
+    ProfileLog profile(profile_path, trace_path);
+    EvalResult result;
 
     while(i <= epochs) {
         size_t j = 1;
         while(j <= batches) {
-            batchtype batch = train.fetch(batch_size);
-            auto sm = nt.forward(batch.first);
-            // Report progress
-            if (j%1 == 0) {
-                float loss = logloss(batch.second, sm);
-                float trainacc = get_accuracy(nt, train);
-                float testacc = get_accuracy(nt, test);
-
-                cout << "Ep:" << i << "/" <<epochs << ", Batch:"; 
-                cout << j << "/" << batches << ") ";
-                cout << setprecision(3) << fixed;
-                cout << "Loss: " << loss << ", Train Acc: " << trainacc;
-                cout << ", Test Acc: " << testacc << endl;
-            }
-
-            nt.backward(sm, batch.second, batch.first); // Find gradients 
-            nt.opt(0.001);                              // Do the learning
+            PROFILE_SCOPE(phase_step, 0, 0, batch_size);
+            const batchtype& batch = prefetch.next();
+            float loss;
+            if(parallel.replicas() > 1) {
+                loss = parallel.gradients(batch.first, batch.second, &prefetch.sparse());
+            } else {
+                loss = nt.gradients(batch.first, batch.second, &prefetch.sparse(), micro);
+            }
+            // Report progress; accuracies arrive later, from the evaluator
+            if (eval_interval && j % eval_interval == 0)
+                evaluator.submit(nt, i, j);
+            cout << "Ep:" << i << "/" <<epochs << ", Batch:"; 
+            cout << j << "/" << batches << ") ";
+            cout << setprecision(3) << fixed;
+            cout << "Loss: " << loss;
+            const InputPath& path = nt.input_path();
+            cout << ", L1 fwd/grad: " << (path.sparse_forward ? "sparse" : "dense");
+            cout << "/" << (path.sparse_grad ? "sparse" : "dense");
+            cout << " (density " << path.density << ", " << path.speedup << "x)" << endl;
+            if(evaluator.poll(result))
+                print_eval(result, epochs, batches);
+
+            nt.opt(0.001);                                          // Do the learning
+            if(checkpoint_interval && j % checkpoint_interval == 0)
+                checkpointer.submit(nt, (i - 1) * batches + j);
             j++;
         }
+        cout << "Loader stalls: " << prefetch.stalls() << ", ";
+        cout << "waited " << prefetch.stall_time() << " s, ";
+        cout << "peak memory " << setprecision(1) << peak_memory() << " MB" << endl;
+        profile.epoch(i);
         i++;
     }
+
+    // The last evaluation still running, then the final parameters
+    evaluator.wait();
+    if(evaluator.poll(result))
+        print_eval(result, epochs, batches);
+    evaluator.submit(nt, epochs, batches);
+    evaluator.wait();
+    if(evaluator.poll(result))
+        print_eval(result, epochs, batches);
+    print_quant(nt, train, test);
+
+    // Save the final parameters
+    checkpointer.wait();
+    checkpointer.submit(nt, epochs * batches);
+    checkpointer.wait();
+    cout << "Checkpoints written: " << checkpointer.written();
+    cout << ", failed: " << checkpointer.failed() << endl;
+    cout << "Peak memory: " << setprecision(1) << peak_memory() << " MB" << endl;
+    profile.epoch(0);
 }
 
@@ -0,0 +1,50 @@
+#include "mnist.h"
+#include <csignal>
+
+// Serve a trained network: server [checkpoint [socket]], where a socket of
+// "-" reads requests from stdin and writes replies to stdout. Latency and
+// throughput are reported on stderr every few seconds.
+int main(int argc, char** argv)
+{
+    const char* ckpt_path = argc > 1 ? argv[1] : checkpoint_path;
+    const string socket_path = argc > 2 ? argv[2] : serve_socket;
+
+    Checkpoint ckpt(ckpt_path);
+    Network<precision, storage> net(ckpt, true, serve_max_batch);
+    BatchServer<Network<precision, storage> > server(net);
+    cerr << "Serving " << ckpt_path << " (step " << ckpt.step() << ") on ";
+    cerr << socket_path << ", batches of up to " << serve_max_batch << " within ";
+    cerr << serve_deadline * 1e3 << " ms" << endl;
+
+    mutex report_mutex;
+    condition_variable report_cond;
+    bool done = false;
+    thread report([&] {
+        unique_lock<mutex> lk(report_mutex);
+        while(!report_cond.wait_for(lk, std::chrono::seconds(5), [&] { return done; })) {
+            const LatencyStats::Summary s = server.stats().take();
+            if(s.count) print_latency(cerr, s);
+        }
+    });
+
+    int status = 0;
+    try {
+        if(socket_path == "-") {
+            signal(SIGPIPE, SIG_IGN);   // the reader of stdout may leave early
+            server.serve(0, 1);
+        } else {
+            server.listen(socket_path);
+        }
+    } catch(const runtime_error& e) {
+        cerr << socket_path << ": " << e.what() << endl;
+        status = 1;
+    }
+    {
+        lock_guard<mutex> lk(report_mutex);
+        done = true;
+    }
+    report_cond.notify_all();
+    report.join();
+    print_latency(cerr, server.stats().take());
+    return status;
+}
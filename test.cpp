@@ -25,6 +25,26 @@ void pd(const Tensor2D<T>& t)
         cout << t.rows() << "x" << t.cols() << endl;
 }
 
+// A batch of n rows: pixel c of row r is (r * c + r) % 255, or 0 unless
+// r * 3 + c is a multiple of sparsity; the label of row r is r % 10
+static batchtype make_batch(size_t n, size_t sparsity = 1)
+{
+    batchtype batch(Tensor2D<uint8_t>(n, pixels), Tensor2D<size_t>(n, 1));
+    for(size_t r = 0; r < n; ++r) {
+        for(size_t c = 0; c < pixels; ++c)
+            batch.first[r][c] = (r * 3 + c) % sparsity ? 0 : (r * c + r) % 255;
+        batch.second[r][0] = r % 10;
+    }
+    return batch;
+}
+
+// Restart genrand(), so that networks built after it start out the same
+static void reseed(unsigned seed)
+{
+    generator.seed(seed);
+    distribution.reset();
+}
+
 
 pair<Tensor2D<precision>, Tensor2D<precision>>
 getmock() {
@@ -80,6 +100,251 @@ void test_dot() {
     pt(dot(p.first, p.second));
 }
 
+// Compare every GEMM kernel the CPU supports against the reference loop
+void test_gemm() {
+    cout << "test_gemm" << endl;
+    const string active = gemm_kernel().name;
+    const size_t m = 37, n = 53, k = 601;   // not multiples of any tile
+    Tensor2D<precision> a(m, k), b(k, n);
+    for(size_t r = 0; r < m; ++r)
+        for(size_t c = 0; c < k; ++c) a[r][c] = genrand();
+    for(size_t r = 0; r < k; ++r)
+        for(size_t c = 0; c < n; ++c) b[r][c] = genrand();
+
+    for(size_t i = 0; i < num_gemm_kernels; ++i) {
+        if(!set_gemm_kernel(gemm_kernels[i].name)) continue;
+        auto t = dot(a, b);
+        double err = 0;
+        for(size_t r = 0; r < m; ++r)
+            for(size_t c = 0; c < n; ++c) {
+                double ref = 0;
+                for(size_t j = 0; j < k; ++j) ref += (double)a[r][j] * b[j][c];
+                err = max(err, fabs(ref - t[r][c]));
+            }
+        cout << gemm_kernels[i].name << " max error " << err << endl;
+        assert(err < 1e-5);
+    }
+    set_gemm_kernel(active);
+}
+
+// Tuned configurations must give the same products, survive a round trip
+// through the tuning file, and leave other machines' entries in it alone
+void test_gemm_autotune() {
+    cout << "test_gemm_autotune" << endl;
+    const char* path = "/tmp/test_tuning.txt";
+    { ofstream other(path); other << "Some other CPU\t4\t0 0 64 64 64\tscalar 64 256 4096 0 1.0\n"; }
+
+    const GemmShape shapes[] = { { false, false, 200, 70, 300 }, { true, false, 300, 70, 200 } };
+    gemm_tuned().clear();
+    assert(gemm_autotune(vector<GemmShape>(shapes, shapes + 2), path) == 2);
+    const vector<GemmTuned> tuned = gemm_tuned();
+    assert(tuned.size() == 2);
+    for(const GemmTuned& t : tuned)
+        cout << t.config.kernel->name << " mc " << t.config.mc << " kc " << t.config.kc
+             << " nc " << t.config.nc << " threads " << t.config.threads << ", ";
+    cout << endl;
+
+    // Nothing left to tune; the same m class uses the same configuration
+    assert(gemm_autotune(vector<GemmShape>(shapes, shapes + 2), path) == 0);
+    const GemmShape near = { false, false, 150, 70, 300 }, far = { false, false, 100, 70, 300 };
+    assert(gemm_config(near).mc == tuned[0].config.mc && gemm_config(near).kernel == tuned[0].config.kernel);
+    assert(gemm_config(far).kc == gemm_kernel().kc && gemm_config(far).threads == 0);
+
+    Tensor2D<precision> a(200, 300), b(300, 70);
+    for(size_t r = 0; r < a.rows(); ++r)
+        for(size_t c = 0; c < a.cols(); ++c) a[r][c] = genrand();
+    for(size_t r = 0; r < b.rows(); ++r)
+        for(size_t c = 0; c < b.cols(); ++c) b[r][c] = genrand();
+    const auto at = transpose(a);
+    const auto tuned_ab = dot(a, b), tuned_tab = dot(at, b, true, false);
+
+    // Read back, then compare with the defaults
+    gemm_tuned().clear();
+    assert(load_gemm_tuning(path) == 2);
+    for(size_t i = 0; i < 2; ++i) {
+        const GemmConfig c = gemm_config(shapes[i]);
+        assert(c.kernel == tuned[i].config.kernel && c.mc == tuned[i].config.mc);
+        assert(c.kc == tuned[i].config.kc && c.nc == tuned[i].config.nc);
+        assert(c.threads == tuned[i].config.threads);
+    }
+    assert(set_gemm_kernel(gemm_kernel().name) && gemm_tuned().empty());
+    const auto ab = dot(a, b), tab = dot(at, b, true, false);
+    double err = 0;
+    for(size_t r = 0; r < ab.rows(); ++r)
+        for(size_t c = 0; c < ab.cols(); ++c)
+            err = max(err, (double)max(fabs(ab[r][c] - tuned_ab[r][c]), fabs(tab[r][c] - tuned_tab[r][c])));
+    cout << "max difference to the defaults " << err << endl;
+    assert(err < 1e-5);
+
+    ifstream in(path);
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    assert(text.find("Some other CPU\t4\t") == 0);
+    unlink(path);
+}
+
+// Transposed operands must match multiplying explicit transposes
+void test_dot_transposed() {
+    cout << "test_dot_transposed" << endl;
+    Tensor2D<precision> a(45, 70), b(70, 33);
+    for(size_t r = 0; r < a.rows(); ++r)
+        for(size_t c = 0; c < a.cols(); ++c) a[r][c] = genrand();
+    for(size_t r = 0; r < b.rows(); ++r)
+        for(size_t c = 0; c < b.cols(); ++c) b[r][c] = genrand();
+    const auto at = transpose(a), bt = transpose(b);
+    const auto ref = dot(a, b);
+
+    auto tn = dot(at, b, true, false);
+    auto nt = dot(a, bt, false, true);
+    auto tt = dot(at, bt, true, true);
+    const Tensor2D<precision>* results[] = { &tn, &nt, &tt };
+    for(size_t i = 0; i < 3; ++i) {
+        double err = 0;
+        for(size_t r = 0; r < ref.rows(); ++r)
+            for(size_t c = 0; c < ref.cols(); ++c)
+                err = max(err, (double)fabs(ref[r][c] - (*results[i])[r][c]));
+        cout << err << " ";
+        assert(err < 1e-6);
+    }
+    cout << endl;
+}
+
+// Results with several threads must match the single-threaded ones
+void test_threads() {
+    cout << "test_threads" << endl;
+    const size_t saved = num_threads();
+    Tensor2D<precision> a(300, 200), b(200, 250);
+    for(size_t r = 0; r < a.rows(); ++r)
+        for(size_t c = 0; c < a.cols(); ++c) a[r][c] = genrand();
+    for(size_t r = 0; r < b.rows(); ++r)
+        for(size_t c = 0; c < b.cols(); ++c) b[r][c] = genrand();
+
+    set_num_threads(1);
+    auto ref = dot(a, b, false, false);
+    auto refsm = softmax(ref);
+    set_num_threads(4);
+    cout << num_threads() << " threads" << endl;
+    auto t = dot(a, b, false, false);
+    auto sm = softmax(t);
+    double err = 0;
+    for(size_t r = 0; r < ref.rows(); ++r)
+        for(size_t c = 0; c < ref.cols(); ++c)
+            err = max(err, (double)fabs(ref[r][c] - t[r][c]) + fabs(refsm[r][c] - sm[r][c]));
+    cout << "max difference " << err << endl;
+    assert(err < 1e-6);
+
+    vector<atomic<int> > hits(1000);
+    parallel_for(hits.size(), [&](size_t i) { hits[i]++; });
+    for(size_t i = 0; i < hits.size(); ++i) assert(hits[i] == 1);
+    set_num_threads(saved);
+}
+
+// The fused bias/ReLU epilogue must match the separate passes, and the
+// mask must mark exactly the positive outputs
+void test_linear() {
+    cout << "test_linear" << endl;
+    const size_t saved = num_threads();
+    Tensor2D<precision> x(130, 70), w(70, 150), b(1, 150);
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c) x[r][c] = genrand();
+    for(size_t r = 0; r < w.rows(); ++r)
+        for(size_t c = 0; c < w.cols(); ++c) w[r][c] = genrand();
+    for(size_t c = 0; c < b.cols(); ++c) b[0][c] = genrand() * 0.1;
+    auto ref = add(dot(x, w), b);
+    relu(ref);
+
+    for(size_t threads = 1; threads <= 4; threads += 3) {
+        set_num_threads(threads);
+        Tensor2D<precision> out(0, 0);
+        Bitmask mask(0, 0);
+        linear(out, x, w, b, true, &mask);
+        size_t bad = 0;
+        for(size_t r = 0; r < ref.rows(); ++r)
+            for(size_t c = 0; c < ref.cols(); ++c) {
+                if(fabs(ref[r][c] - out[r][c]) > 1e-6) bad++;
+                if(mask_bit(mask, r, c) != (ref[r][c] > 0)) bad++;
+            }
+        cout << threads << " threads, " << bad << " mismatches" << endl;
+        assert(bad == 0);
+    }
+    set_num_threads(saved);
+}
+
+// Masking and the bias-gradient reduction done in the GEMM epilogue must
+// match the separate loops
+void test_linear_backward() {
+    cout << "test_linear_backward" << endl;
+    const size_t saved = num_threads();
+    Tensor2D<precision> x(300, 70), w(70, 150), b(1, 150), grad(300, 50), w2(150, 50);
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c) x[r][c] = genrand();
+    for(size_t r = 0; r < w.rows(); ++r)
+        for(size_t c = 0; c < w.cols(); ++c) w[r][c] = genrand();
+    for(size_t r = 0; r < grad.rows(); ++r)
+        for(size_t c = 0; c < grad.cols(); ++c) grad[r][c] = genrand();
+    for(size_t r = 0; r < w2.rows(); ++r)
+        for(size_t c = 0; c < w2.cols(); ++c) w2[r][c] = genrand();
+    Tensor2D<precision> acts(0, 0);
+    Bitmask mask(0, 0);
+    linear(acts, x, w, b, true, &mask);
+
+    auto ref = dot(grad, w2, false, true);
+    Tensor2D<precision> refsum(1, ref.cols());
+    for(size_t r = 0; r < ref.rows(); ++r)
+        for(size_t c = 0; c < ref.cols(); ++c) {
+            if(acts[r][c] == 0) ref[r][c] = 0;
+            refsum[0][c] += ref[r][c];
+        }
+
+    for(size_t threads = 1; threads <= 4; threads += 3) {
+        set_num_threads(threads);
+        Tensor2D<precision> out(0, 0), sum(1, ref.cols());
+        linear_backward(out, grad, w2, mask, sum[0]);
+        double err = 0;
+        for(size_t r = 0; r < ref.rows(); ++r)
+            for(size_t c = 0; c < ref.cols(); ++c)
+                err = max(err, (double)fabs(ref[r][c] - out[r][c]));
+        for(size_t c = 0; c < ref.cols(); ++c)
+            err = max(err, (double)fabs(refsum[0][c] - sum[0][c]));
+        cout << threads << " threads, max error " << err << endl;
+        assert(err < 1e-5);
+    }
+    set_num_threads(saved);
+}
+
+// The 3 layer Network as a Sequential trains to the same bits
+void test_sequential() {
+    cout << "test_sequential" << endl;
+    typedef Sequential<precision, Dense<pixels, 32>, Dense<32, 48>, Dense<48, 10> > Net;
+    static_assert(Net::depth() == 3 && Net::outputs() == 10, "shape");
+    static_assert(Net::params() == pixels * 32 + 32 + 32 * 48 + 48 + 48 * 10 + 10, "params");
+    static_assert(MNISTNetwork::activations() == 512 + 1024 + 10, "activations");
+    const size_t n = 50;
+    const batchtype batch = make_batch(n);
+    reseed(7);
+    Network<precision> ref(pixels, 10, 32, 48, n);
+    reseed(7);
+    Net seq(n);
+    size_t bad = 0;
+    for(size_t step = 0; step < 3; ++step) {
+        const Tensor2D<precision>& s0 = ref.forward(batch.first);
+        const Tensor2D<precision>& s1 = seq.forward(batch.first);
+        for(size_t r = 0; r < n; ++r)
+            for(size_t c = 0; c < 10; ++c) bad += s0[r][c] != s1[r][c];
+        bad += ref.backward(batch.second, batch.first) != seq.backward(batch.second, batch.first);
+        ref.opt();
+        seq.opt();
+    }
+    for(size_t i = 0; i < 3; ++i) {
+        const Tensor2D<precision>& w0 = ref.layer(i).weights;
+        const Tensor2D<precision>& w1 = seq.layer(i).weights;
+        for(size_t r = 0; r < w0.rows(); ++r)
+            for(size_t c = 0; c < w0.cols(); ++c) bad += w0[r][c] != w1[r][c];
+        bad += ref.layer(i).biases[0][0] != seq.layer(i).biases[0][0];
+    }
+    cout << bad << " mismatches" << endl;
+    assert(bad == 0);
+}
+
 void test_add() {
     cout << "test_add" << endl;
     auto p = getmock2();
@@ -98,6 +363,26 @@ void test_mul() {
     pt(mul(p.first, 1.1));
 }
 
+void test_axpy() {
+    cout << "test_axpy" << endl;
+    auto p = getmock2();
+    axpy(p.first, 0.5, p.second);
+    pt(p.first);
+}
+
+// The fused update must match the step spelled out with temporaries
+void test_sgd_update() {
+    cout << "test_sgd_update" << endl;
+    auto p = getmock2();
+    const float lr = 0.1, reg = 0.5;
+    auto ref = sub(p.first, mul(add(p.second, mul(p.first, reg)), lr));
+    sgd_update(p.first, p.second, lr, reg);
+    pt(p.first);
+    for(size_t r = 0; r < ref.rows(); ++r)
+        for(size_t c = 0; c < ref.cols(); ++c)
+            assert(fabs(ref[r][c] - p.first[r][c]) < 1e-6);
+}
+
 void test_transpose() {
     cout << "test_transpose" << endl;
     auto p = getmock();
@@ -110,6 +395,716 @@ void test_softmax() {
     pt(softmax(p.first));
 }
 
+// Byte inputs converted inside GEMM packing must match float inputs
+void test_byte_input() {
+    cout << "test_byte_input" << endl;
+    const float scale = 1.0 / 255;
+    Tensor2D<uint8_t> xb(130, 70);
+    Tensor2D<precision> x(130, 70), w(70, 150), b(1, 150), g(130, 150);
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c) {
+            xb[r][c] = (r * 7 + c * 13) % 256;
+            x[r][c] = xb[r][c] * scale;
+        }
+    for(size_t r = 0; r < w.rows(); ++r)
+        for(size_t c = 0; c < w.cols(); ++c) w[r][c] = genrand();
+    for(size_t c = 0; c < b.cols(); ++c) b[0][c] = genrand() * 0.1;
+    for(size_t r = 0; r < g.rows(); ++r)
+        for(size_t c = 0; c < g.cols(); ++c) g[r][c] = genrand();
+
+    Tensor2D<precision> ref(0, 0), out(0, 0), refgrad(0, 0), grad(0, 0);
+    Bitmask refmask(0, 0), mask(0, 0);
+    linear(ref, x, w, b, true, &refmask);
+    linear(out, xb, w, b, true, &mask, scale);
+    dot(refgrad, x, g, true, false);
+    dot(grad, xb, g, true, false, false, scale);
+    size_t bad = 0;
+    for(size_t r = 0; r < ref.rows(); ++r)
+        for(size_t c = 0; c < ref.cols(); ++c) {
+            if(fabs(ref[r][c] - out[r][c]) > 1e-5) bad++;
+            if(mask_bit(mask, r, c) != mask_bit(refmask, r, c)) bad++;
+        }
+    for(size_t r = 0; r < refgrad.rows(); ++r)
+        for(size_t c = 0; c < refgrad.cols(); ++c)
+            if(fabs(refgrad[r][c] - grad[r][c]) > 1e-4) bad++;
+    cout << bad << " mismatches" << endl;
+    assert(bad == 0);
+}
+
+// bf16 and fp16 must round like the hardware, and a network storing its
+// weights and activations in them must train like the float one
+void test_half() {
+    cout << "test_half" << endl;
+    size_t bad = 0;
+
+    // Exact values, rounding to nearest even, and the special values
+    const float exact[] = { 0.0f, -0.0f, 1.0f, -2.5f, 0.15625f, 6.103515625e-05f };
+    for(float f : exact)
+        if((float)bf16(f) != f || (float)fp16(f) != f) bad++;
+    if((float)fp16(65504.0f) != 65504.0f || (float)bf16(-65280.0f) != -65280.0f) bad++;
+    if((float)bf16(1.0f + 1.0f / 256) != 1.0f) bad++;
+    if((float)bf16(1.0f + 3.0f / 256) != 1.0f + 4.0f / 256) bad++;
+    if((float)fp16(1.0f + 1.0f / 2048) != 1.0f) bad++;
+    if((float)fp16(5.96046448e-08f) != 5.96046448e-08f) bad++;     // smallest subnormal
+    if(!std::isinf((float)fp16(70000.0f)) || !std::isinf((float)bf16(INFINITY))) bad++;
+    if(!std::isnan((float)fp16(NAN)) || !std::isnan((float)bf16(NAN))) bad++;
+    cout << "scalar: " << bad << " mismatches" << endl;
+
+    // The vector converters round like the scalar ones
+    const size_t n = 1037;
+    vector<float> src(n), back(n);
+    vector<bf16> b(n);
+    vector<fp16> h(n);
+    for(size_t i = 0; i < n; ++i) src[i] = genrand() * (i % 7 ? 100 : 1e-5);
+    convert_row(src.data(), b.data(), n);
+    convert_row(src.data(), h.data(), n);
+    for(size_t i = 0; i < n; ++i) {
+        if(b[i].bits != bf16(src[i]).bits && fabs(src[i]) > 1.2e-38) bad++;
+        if(h[i].bits != fp16(src[i]).bits) bad++;
+    }
+    convert_row(b.data(), back.data(), n);
+    for(size_t i = 0; i < n; ++i) if(back[i] != (float)b[i]) bad++;
+    convert_row(h.data(), back.data(), n);
+    for(size_t i = 0; i < n; ++i) if(back[i] != (float)h[i]) bad++;
+    cout << "rows: " << bad << " mismatches" << endl;
+
+    // 16 bit operands and outputs are summed in float, rounded once
+    Tensor2D<precision> x(70, 300), w(300, 90), bias(1, 90), ref(0, 0);
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c) x[r][c] = genrand() * 100;
+    for(size_t r = 0; r < w.rows(); ++r)
+        for(size_t c = 0; c < w.cols(); ++c) w[r][c] = genrand();
+    for(size_t c = 0; c < bias.cols(); ++c) bias[0][c] = genrand();
+    Tensor2D<bf16> xb(0, 0), wb(0, 0), outb(0, 0);
+    Tensor2D<fp16> wh(0, 0), outh(0, 0);
+    convert(xb, x);
+    convert(wb, w);
+    convert(wh, w);
+    Tensor2D<precision> xr(0, 0), wr(0, 0);
+    convert(xr, xb);
+    convert(wr, wb);
+    linear(ref, xr, wr, bias, false);
+    linear(outb, xb, wb, bias, false, nullptr, 1.0f);
+    for(size_t r = 0; r < ref.rows(); ++r)
+        for(size_t c = 0; c < ref.cols(); ++c)
+            if((float)outb[r][c] != (float)bf16(ref[r][c])) bad++;
+    linear(ref, x, w, bias, false);
+    linear(outh, x, wh, bias, false, nullptr, 1.0f);
+    for(size_t r = 0; r < ref.rows(); ++r)
+        for(size_t c = 0; c < ref.cols(); ++c)
+            if(fabs(outh[r][c] - ref[r][c]) > 1e-3 * (1 + fabs(ref[r][c]))) bad++;
+    cout << "gemm: " << bad << " mismatches" << endl;
+
+    // A training step with bf16 storage follows the float one closely
+    const size_t rows = 40;
+    const batchtype batch = make_batch(rows);
+    reseed(11);
+    Network<precision> full(pixels, 10, 32, 48, rows);
+    reseed(11);
+    Network<precision, bf16> half(pixels, 10, 32, 48, rows);
+    float loss[2][2];
+    for(size_t step = 0; step < 2; ++step) {
+        full.forward(batch.first);
+        half.forward(batch.first);
+        loss[0][step] = full.backward(batch.second, batch.first);
+        loss[1][step] = half.backward(batch.second, batch.first);
+        full.opt();
+        half.opt();
+    }
+    cout << "loss " << loss[0][1] << " vs " << loss[1][1] << endl;
+    for(size_t step = 0; step < 2; ++step)
+        if(fabs(loss[0][step] - loss[1][step]) > 1e-3 * loss[0][step]) bad++;
+    assert(bad == 0);
+}
+
+// Sparse kernels for the first layer must match the dense ones, with every
+// kernel the CPU supports
+void test_sparse_input() {
+    cout << "test_sparse_input" << endl;
+    const float scale = 1.0 / 255;
+    Tensor2D<uint8_t> x(90, 100);
+    Tensor2D<precision> w(100, 150), b(1, 150), g(90, 150);
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c)
+            x[r][c] = (r * 31 + c * 17) % 5 == 0 ? (r + c) % 255 + 1 : 0;
+    x[7][0] = 0;
+    for(size_t c = 0; c < x.cols(); ++c) x[8][c] = 0;     // an empty row
+    for(size_t r = 0; r < w.rows(); ++r)
+        for(size_t c = 0; c < w.cols(); ++c) w[r][c] = genrand();
+    for(size_t c = 0; c < b.cols(); ++c) b[0][c] = genrand() * 0.1;
+    for(size_t r = 0; r < g.rows(); ++r)
+        for(size_t c = 0; c < g.cols(); ++c) g[r][c] = genrand();
+
+    SparseBytes s;
+    to_sparse(s, x);
+    size_t nnz = 0;
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c) nnz += x[r][c] != 0;
+    assert(s.rows() == 90 && s.nnz() == nnz && s.rowptr[9] == s.rowptr[8]);
+    cout << "density " << s.density() << endl;
+
+    Tensor2D<precision> ref(0, 0), refgrad(0, 0);
+    Bitmask refmask(0, 0);
+    linear(ref, x, w, b, true, &refmask, scale);
+    dot(refgrad, x, g, true, false, false, scale);
+
+    SparseKernel* saved = active_sparse_kernel;
+    for(size_t k = 0; k < num_sparse_kernels; ++k) {
+        if(!set_sparse_kernel(sparse_kernels[k].name)) continue;
+        Tensor2D<precision> out(0, 0), grad(0, 0);
+        Bitmask mask(0, 0);
+        linear(out, s, w, b, true, &mask, scale);
+        dot_sparse_t(grad, s, g, scale);
+        size_t bad = 0;
+        for(size_t r = 0; r < ref.rows(); ++r)
+            for(size_t c = 0; c < ref.cols(); ++c) {
+                if(fabs(ref[r][c] - out[r][c]) > 1e-5) bad++;
+                if(mask_bit(mask, r, c) != mask_bit(refmask, r, c)) bad++;
+            }
+        for(size_t r = 0; r < refgrad.rows(); ++r)
+            for(size_t c = 0; c < refgrad.cols(); ++c)
+                if(fabs(refgrad[r][c] - grad[r][c]) > 1e-4) bad++;
+        cout << sparse_kernels[k].name << ": " << bad << " mismatches" << endl;
+        assert(bad == 0);
+    }
+    active_sparse_kernel = saved;
+}
+
+// The int8 layer against its float original, with every kernel giving the
+// same sums
+void test_quant() {
+    cout << "test_quant" << endl;
+    const float in_scale = 0.02, out_scale = 0.05;
+    Linear<precision> layer(70, 37);
+    Tensor2D<uint8_t> x(13, 70);
+    for(size_t r = 0; r < x.rows(); ++r)
+        for(size_t c = 0; c < x.cols(); ++c) x[r][c] = (r * 37 + c * 11) % 128;
+    for(size_t c = 0; c < layer.biases.cols(); ++c) layer.biases[0][c] = genrand();
+
+    // Rounding a weight moves each product by at most half a step of its
+    // column's scale
+    Tensor2D<precision> ref(0, 0), tol(x.rows(), layer.weights.cols());
+    layer.forward(x, ref, nullptr, in_scale);
+    for(size_t c = 0; c < tol.cols(); ++c) {
+        float wmax = 0;
+        for(size_t k = 0; k < x.cols(); ++k) wmax = max(wmax, fabsf(layer.weights[k][c]));
+        for(size_t r = 0; r < x.rows(); ++r) {
+            float xsum = 0;
+            for(size_t k = 0; k < x.cols(); ++k) xsum += x[r][k] * in_scale;
+            tol[r][c] = 0.5 * wmax / 127 * xsum + 1e-5;
+        }
+    }
+    size_t bad = 0;
+
+    Tensor2D<float> first(0, 0);
+    QGemmKernel* saved = active_qgemm_kernel;
+    for(size_t k = 0; k < num_qgemm_kernels; ++k) {
+        if(!set_qgemm_kernel(qgemm_kernels[k].name)) continue;
+        QuantLinear q(layer, true, in_scale, out_scale);
+        Tensor2D<float> out(0, 0);
+        Tensor2D<uint8_t> qout(0, 0);
+        q.forward(x, out);
+        q.forward(x, qout);
+        if(k == 0) first = out;
+        for(size_t r = 0; r < out.rows(); ++r)
+            for(size_t c = 0; c < out.cols(); ++c) {
+                if(out[r][c] != first[r][c]) bad++;
+                if(fabs(out[r][c] - max(ref[r][c], 0.0f)) > tol[r][c]) bad++;
+                const float expect = min(out[r][c] / out_scale, 127.0f);
+                if(fabs(qout[r][c] - expect) > 0.5001) bad++;
+            }
+        cout << qgemm_kernels[k].name << ": " << bad << " mismatches" << endl;
+    }
+    active_qgemm_kernel = saved;
+
+    // The quantized network scores batches close to the float one
+    const size_t n = 60;
+    Tensor2D<uint8_t> batch(n, pixels);
+    for(size_t r = 0; r < n; ++r)
+        for(size_t c = 0; c < pixels; ++c) batch[r][c] = (r * c + r) % 7 ? 0 : (r + c) % 256;
+    Network<precision> net(pixels, 10, 32, 48, n);
+    QuantNetwork qnet(net, batch);
+    const Tensor2D<precision> scores = net.forward(batch);
+    const Tensor2D<float>& qscores = qnet.forward(batch);
+    float err = 0, range = 0;
+    for(size_t r = 0; r < n; ++r)
+        for(size_t c = 0; c < 10; ++c) {
+            err = max(err, fabsf(scores[r][c] - qscores[r][c]));
+            range = max(range, fabsf(scores[r][c]));
+        }
+    cout << "network: error " << err << " of " << range << endl;
+    if(err > 0.05 * range) bad++;
+    assert(bad == 0);
+}
+
+// Data-parallel gradients must match those of the whole batch, and be
+// reproducible when reduced deterministically
+void test_data_parallel() {
+    cout << "test_data_parallel" << endl;
+    const size_t n = 50;
+    const size_t saved = num_threads();
+    set_num_threads(3);
+    const batchtype batch = make_batch(n);
+    SparseBytes sparse;
+    to_sparse(sparse, batch.first);
+    Network<precision> ref(pixels, 10, 32, 48, n);
+    Network<precision> det1(ref, n), det2(ref, n), racy(ref, n);
+    DataParallel<precision> dp1(det1, 3, n, true), dp2(det2, 3, n, true);
+    DataParallel<precision> dp3(racy, 4, n, false);
+
+    // Two steps, so that the replicas must see the first one; the second
+    // allocates no tensors for them
+    float loss = 0;
+    for(size_t step = 0; step < 2; ++step) {
+        ref.forward(batch.first);
+        loss = ref.backward(batch.second, batch.first);
+        ref.opt();
+        const size_t allocs = tensor_allocs;
+        const float loss1 = dp1.gradients(batch.first, batch.second);
+        dp2.gradients(batch.first, batch.second);
+        dp3.gradients(batch.first, batch.second, &sparse);
+        det1.opt(); det2.opt(); racy.opt();
+        assert(fabs(loss - loss1) < 1e-5);
+        assert(step == 0 || tensor_allocs == allocs);
+    }
+
+    // Compare the scores after the step
+    const Tensor2D<precision> s0 = ref.forward(batch.first);
+    const Tensor2D<precision> s1 = det1.forward(batch.first);
+    const Tensor2D<precision> s2 = det2.forward(batch.first);
+    const Tensor2D<precision> s3 = racy.forward(batch.first);
+    size_t bad = 0;
+    for(size_t r = 0; r < n; ++r)
+        for(size_t c = 0; c < 10; ++c) {
+            if(fabs(s0[r][c] - s1[r][c]) > 1e-4 || fabs(s0[r][c] - s3[r][c]) > 1e-4) bad++;
+            if(s1[r][c] != s2[r][c]) bad++;
+        }
+    cout << "loss " << loss << ", " << bad << " mismatches" << endl;
+    assert(bad == 0);
+    set_num_threads(saved);
+}
+
+// Micro-batches must give the gradients and loss of the whole batch, on the
+// dense and the sparse input path, without outgrowing their workspace
+void test_micro_batch() {
+    cout << "test_micro_batch" << endl;
+    const size_t n = 64;
+    const batchtype batch = make_batch(n, 7);
+    SparseBytes sparse;
+    to_sparse(sparse, batch.first);
+
+    Network<precision> init(pixels, 10, 32, 48, 1), ref(init, n);
+    const float loss = ref.gradients(batch.first, batch.second);
+    for(size_t micro : { (size_t)16, (size_t)24 }) {
+        for(const SparseBytes* sp : { (const SparseBytes*)nullptr, (const SparseBytes*)&sparse }) {
+            Network<precision> net(init, micro);
+            const size_t allocs = tensor_allocs;
+            // Bias gradients add up over calls, weight gradients are replaced
+            for(size_t calls = 1; calls <= 2; ++calls) {
+                const float mloss = net.gradients(batch.first, batch.second, sp, micro);
+                double err = 0;
+                for(size_t l = 0; l < 3; ++l) {
+                    const Linear<precision>& a = ref.layer(l);
+                    const Linear<precision>& b = net.layer(l);
+                    for(size_t r = 0; r < a.weights_grad.rows(); ++r)
+                        for(size_t c = 0; c < a.weights_grad.cols(); ++c)
+                            err = max(err, (double)fabs(a.weights_grad[r][c] - b.weights_grad[r][c]));
+                    for(size_t c = 0; c < a.biases_grad.cols(); ++c)
+                        err = max(err, (double)fabs(calls * a.biases_grad[0][c] - b.biases_grad[0][c]));
+                }
+                cout << micro << (sp ? " sparse" : " dense") << ", call " << calls << ": loss "
+                     << mloss << ", max error " << err << endl;
+                assert(fabs(loss - mloss) < 1e-5);
+                assert(err < 1e-5);
+            }
+            assert(tensor_allocs == allocs);
+        }
+    }
+}
+
+// After the first step, training must not allocate any tensor memory
+void test_steady_state_allocs() {
+    cout << "test_steady_state_allocs" << endl;
+    const size_t n = 64;
+    Network<precision> nt(pixels, 10, 32, 48, n);
+    const batchtype batch = make_batch(n);
+
+    nt.forward(batch.first);
+    nt.backward(batch.second, batch.first);
+    nt.opt();
+    const size_t before = tensor_allocs;
+    for(size_t i = 0; i < 3; ++i) {
+        nt.forward(batch.first);
+        nt.backward(batch.second, batch.first);
+        nt.opt();
+    }
+    cout << tensor_allocs - before << " allocations in 3 steps" << endl;
+    assert(tensor_allocs == before);
+}
+
+// Every softmax kernel must agree with a double precision reference on the
+// loss, the gradient and the prediction
+void test_softmax_xent() {
+    cout << "test_softmax_xent" << endl;
+    const SoftmaxKernel* saved = active_softmax_kernel;
+    for(size_t cols = 10; cols <= 37; cols += 27) {
+        Tensor2D<precision> scores(200, cols);
+        Tensor2D<size_t> labels(200, 1);
+        for(size_t r = 0; r < scores.rows(); ++r) {
+            for(size_t c = 0; c < cols; ++c) scores[r][c] = genrand() * 500;
+            labels[r][0] = r % cols;
+        }
+        double refloss = 0;
+        Tensor2D<double> refgrad(scores.rows(), cols);
+        Tensor2D<size_t> predicted(0, 0);
+        argmax(predicted, scores);
+        for(size_t r = 0; r < scores.rows(); ++r) {
+            double max = scores[r][0], sum = 0;
+            for(size_t c = 0; c < cols; ++c) max = std::max(max, (double)scores[r][c]);
+            assert(scores[r][predicted[r][0]] == max);
+            for(size_t c = 0; c < cols; ++c) sum += exp(scores[r][c] - max);
+            for(size_t c = 0; c < cols; ++c)
+                refgrad[r][c] = (exp(scores[r][c] - max) / sum - (c == labels[r][0])) / scores.rows();
+            refloss += log(sum) - (scores[r][labels[r][0]] - max);
+        }
+        refloss /= scores.rows();
+
+        for(size_t i = 0; i < num_softmax_kernels; ++i) {
+            if(!set_softmax_kernel(softmax_kernels[i].name)) continue;
+            Tensor2D<precision> grad(0, 0);
+            float loss = softmax_xent(scores, labels, grad);
+            double err = 0;
+            for(size_t r = 0; r < scores.rows(); ++r)
+                for(size_t c = 0; c < cols; ++c)
+                    err = max(err, fabs(refgrad[r][c] - grad[r][c]) * scores.rows());
+            cout << cols << " cols, " << softmax_kernels[i].name << " loss " << loss
+                 << " (" << refloss << "), max error " << err << endl;
+            assert(err < 1e-5 && fabs(loss - refloss) < 1e-4);
+        }
+    }
+    active_softmax_kernel = const_cast<SoftmaxKernel*>(saved);
+}
+
+// Write a small IDX file, big endian header first
+void write_idx(const char* path, const vector<unsigned int>& dims, const vector<uint8_t>& data)
+{
+    ofstream fd(path, ios::out | ios::binary);
+    const char magic[4] = { 0, 0, 0x08, (char)dims.size() };
+    fd.write(magic, 4);
+    for(size_t i = 0; i < dims.size(); ++i) {
+        const char be[4] = { (char)(dims[i] >> 24), (char)(dims[i] >> 16),
+                             (char)(dims[i] >> 8), (char)dims[i] };
+        fd.write(be, 4);
+    }
+    fd.write((const char*)data.data(), data.size());
+}
+
+void test_idx() {
+    cout << "test_idx" << endl;
+    const size_t n = 7;
+    vector<uint8_t> images(n * pixels), labels(n);
+    for(size_t i = 0; i < n; ++i) {
+        labels[i] = i;
+        for(size_t p = 0; p < pixels; ++p) images[i * pixels + p] = i;
+    }
+    write_idx("/tmp/test-images-idx3-ubyte", {(unsigned)n, 28, 28}, images);
+    write_idx("/tmp/test-labels-idx1-ubyte", {(unsigned)n}, labels);
+
+    MNISTDataLoader loader("/tmp/test-images-idx3-ubyte", "/tmp/test-labels-idx1-ubyte");
+    cout << loader.numitems() << " items" << endl;
+    assert(loader.numitems() == n && loader.images()[3 * pixels] == 3);
+    batchtype batch = loader.fetch(20);
+    for(size_t r = 0; r < 20; ++r)
+        assert(batch.first[r][pixels - 1] == batch.second[r][0]);
+
+    // Labels are not 28x28 images
+    bool thrown = false;
+    try { MNISTDataLoader bad("/tmp/test-labels-idx1-ubyte", "/tmp/test-labels-idx1-ubyte"); }
+    catch(const runtime_error& e) { thrown = true; cout << e.what() << endl; }
+    assert(thrown);
+
+    // Dimensions whose product wraps around to 0
+    write_idx("/tmp/test-wrap-idx4-ubyte", {65536, 65536, 65536, 65536}, vector<uint8_t>());
+    thrown = false;
+    try { IDXFile bad("/tmp/test-wrap-idx4-ubyte"); }
+    catch(const runtime_error& e) { thrown = true; }
+    assert(thrown);
+    unlink("/tmp/test-wrap-idx4-ubyte");
+}
+
+// Batches from the background threads must be complete and consistent
+void test_prefetch() {
+    cout << "test_prefetch" << endl;
+    MNISTDataLoader loader("/tmp/test-images-idx3-ubyte", "/tmp/test-labels-idx1-ubyte");
+    BatchPrefetcher prefetch(loader, 16, 3, 2);
+    for(size_t i = 0; i < 50; ++i) {
+        const batchtype& batch = prefetch.next();
+        assert(batch.first.rows() == 16 && batch.second.rows() == 16);
+        for(size_t r = 0; r < 16; ++r)
+            assert(batch.first[r][0] == batch.second[r][0]);
+    }
+    cout << "depth " << prefetch.depth() << ", queued " << prefetch.queued()
+         << ", stalls " << prefetch.stalls() << endl;
+}
+
+void test_sampler() {
+    cout << "test_sampler" << endl;
+    const size_t n = 103;
+    for(size_t block : { 1, 8 }) {
+        EpochSampler s1(n, 7, block), s2(n, 7, block);
+        Tensor2D<size_t> a(100, 1), b(100, 1);
+        vector<size_t> seen(n, 0), first;
+        // 100 items per batch: batches straddle epochs
+        for(size_t i = 0; i < 3; ++i) {
+            s1.next(a, 100);
+            s2.next(b, 100);
+            for(size_t r = 0; r < 100; ++r) {
+                assert(a[r][0] == b[r][0]);
+                assert(r == 0 || a[r-1][0] <= a[r][0]);
+                if(i == 0) first.push_back(a[r][0]);
+                if(i < 2) seen[a[r][0]]++;
+            }
+        }
+        // first epoch (103) plus start of the second: every item once or twice
+        for(size_t k = 0; k < n; ++k)
+            assert(seen[k] >= 1 && seen[k] <= 2);
+        assert(s1.epoch() == 2);
+
+        EpochSampler s3(n, 8, block);
+        s3.next(b, 100);
+        size_t same = 0;
+        for(size_t r = 0; r < 100; ++r) same += (b[r][0] == first[r]);
+        assert(same < 100);
+    }
+
+    // Whole epochs as single batches are sorted permutations, each item
+    // copied to its own row
+    MNISTDataLoader loader("/tmp/test-images-idx3-ubyte", "/tmp/test-labels-idx1-ubyte", 3, 4);
+    batchtype batch(Tensor2D<uint8_t>(7, pixels), Tensor2D<size_t>(7, 1));
+    for(size_t e = 0; e < 3; ++e) {
+        loader.fetch(batch);
+        for(size_t r = 0; r < 7; ++r) {
+            assert(batch.second[r][0] == r);
+            for(size_t p = 0; p < pixels; ++p)
+                assert(batch.first[r][p] == r);
+        }
+    }
+}
+
+// Streamed and background evaluation must agree with predict()
+void test_eval() {
+    cout << "test_eval" << endl;
+    MNISTDataLoader loader("/tmp/test-images-idx3-ubyte", "/tmp/test-labels-idx1-ubyte");
+    Network<precision> nt(pixels, 10, 32, 48, 16);
+    batchtype all(Tensor2D<uint8_t>(7, pixels), Tensor2D<size_t>(7, 1));
+    loader.fetch(all, 0, 7);
+    Tensor2D<size_t> predicted(0, 0);
+    nt.predict(all.first, predicted);
+    size_t correct = 0;
+    for(size_t r = 0; r < 7; ++r)
+        correct += predicted[r][0] == all.second[r][0];
+    const float expected = (float)correct / 7;
+
+    batchtype chunk(Tensor2D<uint8_t>(3, pixels), Tensor2D<size_t>(3, 1));
+    assert(accuracy(nt, loader, 7, chunk, predicted) == expected);
+
+    Evaluator<precision> ev(nt, loader, loader, 3);
+    EvalResult r;
+    assert(!ev.poll(r));
+    assert(ev.submit(nt, 1, 2));
+    ev.wait();
+    assert(ev.poll(r) && !ev.poll(r));
+    cout << "accuracy " << r.test_acc << endl;
+    assert(r.epoch == 1 && r.batch == 2 && r.test_acc == expected && r.train_acc == expected);
+}
+
+// Parameters survive a checkpoint, copied or mapped in place
+void test_checkpoint() {
+    cout << "test_checkpoint" << endl;
+    const char* path = "test.ckpt";
+    const size_t n = 20;
+    Tensor2D<uint8_t> batch(n, pixels);
+    Tensor2D<size_t> labels(n, 1);
+    for(size_t r = 0; r < n; ++r) {
+        for(size_t c = 0; c < pixels; ++c) batch[r][c] = (r * c + r) % 255;
+        labels[r][0] = r % 10;
+    }
+    Network<precision> a(pixels, 10, 32, 48, n);
+    Network<precision> copied(pixels, 10, 32, 48, n);
+    a.forward(batch);
+    a.backward(labels, batch);
+    a.opt();
+    a.save(path, 42);
+    const Tensor2D<precision> expect = a.forward(batch);
+
+    size_t bad = 0;
+    {
+        Checkpoint ckpt(path);
+        Network<precision> mapped(pixels, 10, 32, 48, n);
+        assert(ckpt.size() == 6 && ckpt.step() == 42);
+        copied.load(ckpt);
+        mapped.load(ckpt, true);
+        assert(!copied.layer(0).weights.is_view() && mapped.layer(0).weights.is_view());
+        const Tensor2D<precision>& s1 = copied.forward(batch);
+        const Tensor2D<precision>& s2 = mapped.forward(batch);
+        for(size_t r = 0; r < n; ++r)
+            for(size_t c = 0; c < 10; ++c) bad += s1[r][c] != expect[r][c] || s2[r][c] != expect[r][c];
+
+        // Built straight from the checkpoint
+        Network<precision> built(ckpt, true, n);
+        const Tensor2D<precision>& s0 = built.forward(batch);
+        for(size_t r = 0; r < n; ++r)
+            for(size_t c = 0; c < 10; ++c) bad += s0[r][c] != expect[r][c];
+
+        // Training on the mapping leaves the file as it was
+        mapped.backward(labels, batch);
+        mapped.opt();
+    }
+    Checkpoint again(path);
+    copied.load(again);
+    const Tensor2D<precision>& s3 = copied.forward(batch);
+    for(size_t r = 0; r < n; ++r)
+        for(size_t c = 0; c < 10; ++c) bad += s3[r][c] != expect[r][c];
+
+    // Written in the background
+    {
+        Checkpointer<precision> writer(a, path);
+        a.backward(labels, batch);
+        a.opt();
+        assert(writer.submit(a, 43));
+        writer.wait();
+        assert(writer.written() == 1 && writer.failed() == 0);
+        Checkpoint ckpt(path);
+        copied.load(ckpt);
+        const Tensor2D<precision> s4 = a.forward(batch);
+        const Tensor2D<precision>& s5 = copied.forward(batch);
+        for(size_t r = 0; r < n; ++r)
+            for(size_t c = 0; c < 10; ++c) bad += s4[r][c] != s5[r][c];
+        bad += ckpt.step() != 43;
+    }
+
+    // A checkpoint of another shape, one with a tensor larger than the
+    // file, and no checkpoint at all
+    Network<precision> other(pixels, 10, 16, 48, n);
+    size_t thrown = 0;
+    try { Checkpoint ckpt(path); other.load(ckpt); } catch(const runtime_error&) { thrown++; }
+    {
+        // A first tensor of 2^31 rows of 2^33 bytes, whose size wraps to 0
+        const uint32_t huge = 1u << 31;
+        fstream out(path, ios::binary | ios::in | ios::out);
+        out.seekp(sizeof(CheckpointHeader) + offsetof(CheckpointEntry, rows));
+        out.write(reinterpret_cast<const char*>(&huge), sizeof(huge));
+        out.seekp(sizeof(CheckpointHeader) + offsetof(CheckpointEntry, stride));
+        out.write(reinterpret_cast<const char*>(&huge), sizeof(huge));
+    }
+    try { Checkpoint ckpt(path); } catch(const runtime_error&) { thrown++; }
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out << "MNISTCKP but not really";
+    }
+    try { Checkpoint ckpt(path); } catch(const runtime_error&) { thrown++; }
+    unlink(path);
+    cout << bad << " mismatches, " << thrown << " rejected" << endl;
+    assert(bad == 0 && thrown == 3);
+}
+
+// Pipelined requests over a socket come back in order, batched, with the
+// network's own answers
+void test_server() {
+    cout << "test_server" << endl;
+    const size_t n = 40, max_batch = 8;
+    Tensor2D<uint8_t> images(n, pixels);
+    for(size_t r = 0; r < n; ++r)
+        for(size_t c = 0; c < pixels; ++c) images[r][c] = (r * c + r) % 7 ? 0 : (r + c) % 256;
+    Network<precision> net(pixels, 10, 32, 48, max_batch);
+    const Tensor2D<precision> expect = net.eval(images);
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    BatchServer<Network<precision> > server(net, max_batch, 0.05);
+    thread conn([&] { server.serve(fds[1], fds[1]); });
+    for(size_t r = 0; r < n; ++r) assert(write_full(fds[0], images[r], pixels));
+    size_t bad = 0;
+    for(size_t r = 0; r < n; ++r) {
+        InferenceReply reply;
+        assert(read_full(fds[0], &reply, sizeof(reply)));
+        bad += reply.label != maxidx(expect[r], 10);
+        for(size_t c = 0; c < 10; ++c) bad += fabs(reply.probs[c] - expect[r][c]) > 1e-6;
+    }
+    shutdown(fds[0], SHUT_WR);
+    conn.join();
+    close(fds[0]);
+    close(fds[1]);
+
+    const LatencyStats::Summary s = server.stats().take();
+    cout << bad << " mismatches, " << s.batches << " batches" << endl;
+    assert(bad == 0 && s.count == n && s.batches < n && s.p50 <= s.p99);
+
+    // A client leaving without its replies must not raise SIGPIPE
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    thread gone([&] { server.serve(fds[1], fds[1]); });
+    for(size_t r = 0; r < n; ++r) assert(write_full(fds[0], images[r], pixels));
+    close(fds[0]);
+    gone.join();
+    close(fds[1]);
+
+    // listen() must not remove what is not a socket
+    const char* path = "/tmp/test-not-a-socket";
+    { ofstream file(path); file << "data"; }
+    bool thrown = false;
+    try { server.listen(path); }
+    catch(const runtime_error& e) { thrown = true; }
+    struct stat st;
+    assert(thrown && stat(path, &st) == 0);
+    unlink(path);
+}
+
+// Scopes add up per phase; those within an evaluation are only traced
+void test_profile() {
+    cout << "test_profile" << endl;
+    const size_t n = 64;
+    Network<precision> nt(pixels, 10, 32, 48, n);
+    const batchtype batch = make_batch(n);
+
+    profiler().take();
+    profiler().trace(true);
+    for(size_t i = 0; i < 2; ++i) {
+        nt.forward(batch.first);
+        nt.backward(batch.second, batch.first);
+        nt.opt();
+    }
+    {
+        ProfileScope eval(phase_eval, 0, 0, n);
+        nt.forward(batch.first);
+        Tensor2D<float> t(n, n);
+    }
+    profiler().trace(false);
+    const vector<PhaseStats> stats = profiler().take();
+#if MNIST_PROFILE
+    const double macs = pixels * 32 + 32 * 48 + 48 * 10;
+    assert(stats[phase_forward].calls == 2);
+    assert(stats[phase_forward].items == 2 * n);
+    assert(stats[phase_forward].flops == 2 * 2 * n * macs);
+    assert(stats[phase_linear].calls == 6);
+    assert(stats[phase_backward].calls == 2 && stats[phase_opt].calls == 2);
+    assert(stats[phase_eval].allocs == 1);
+#endif
+    assert(stats[phase_eval].calls == 1 && stats[phase_eval].items == n);
+    assert(profiler().take()[phase_eval].calls == 0);
+
+    // 2 * 6 scopes of training, 1 + 1 + 3 of the evaluation
+    assert(profiler().write_trace("test_trace.json"));
+    ifstream in("test_trace.json");
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    size_t events = 0;
+    for(size_t at = text.find("\"ph\": \"X\""); at != string::npos; at = text.find("\"ph\": \"X\"", at + 1))
+        events++;
+    cout << events << " trace events" << endl;
+    assert(events == (MNIST_PROFILE ? 2 * 6 + 5 : 1));
+    assert(text.find("\"name\": \"linear\"") != string::npos || !MNIST_PROFILE);
+    unlink("test_trace.json");
+}
+
 void test_memory() {
     cout << "test_memory" << endl;
     for(size_t i = 0; i < 10; ++i) {
@@ -127,11 +1122,35 @@ int main()
 {
     test_tensor();
     test_dot();
+    test_gemm();
+    test_gemm_autotune();
+    test_dot_transposed();
+    test_threads();
+    test_linear();
+    test_linear_backward();
+    test_byte_input();
+    test_half();
+    test_sparse_input();
+    test_quant();
+    test_data_parallel();
+    test_micro_batch();
+    test_sequential();
     test_add();
     test_sub();
     test_mul();
+    test_axpy();
+    test_sgd_update();
     test_transpose();
     test_softmax();
+    test_softmax_xent();
+    test_steady_state_allocs();
+    test_idx();
+    test_prefetch();
+    test_sampler();
+    test_eval();
+    test_checkpoint();
+    test_server();
+    test_profile();
     test_memory();
 
     return 0;